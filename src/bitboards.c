@@ -63,6 +63,7 @@ INLINE unsigned magic_hash(struct magic *m, u64 occ)
 }
 
 static u64 between[SQUARE_NB][SQUARE_NB];     /* [square][square] */
+static u64 line[SQUARE_NB][SQUARE_NB];        /* [square][square] */
 static int distance[SQUARE_NB][SQUARE_NB];    /* [square][square] */
 static u64 pawn_attacks[COLOR_NB][SQUARE_NB]; /* [color][square] */
 static u64 king_attacks[SQUARE_NB];           /* [square] */
@@ -91,10 +92,18 @@ void bb_init(void)
 				    bb_attacks(BISHOP, sq,
 					       BB_FROM_SQUARE(sq2)) &
 				    bb_attacks(BISHOP, sq2, BB_FROM_SQUARE(sq));
+				line[sq][sq2] =
+				    (bb_attacks(BISHOP, sq, 0ULL) &
+				     bb_attacks(BISHOP, sq2, 0ULL)) |
+				    BB_FROM_SQUARE(sq) | BB_FROM_SQUARE(sq2);
 			} else if (BB_TEST(bb_attacks(ROOK, sq, 0ULL), sq2)) {
 				between[sq][sq2] =
 				    bb_attacks(ROOK, sq, BB_FROM_SQUARE(sq2)) &
 				    bb_attacks(ROOK, sq2, BB_FROM_SQUARE(sq));
+				line[sq][sq2] =
+				    (bb_attacks(ROOK, sq, 0ULL) &
+				     bb_attacks(ROOK, sq2, 0ULL)) |
+				    BB_FROM_SQUARE(sq) | BB_FROM_SQUARE(sq2);
 			}
 			BB_SET(between[sq][sq2], sq);
 			BB_SET(between[sq][sq2], sq2);
@@ -137,6 +146,12 @@ u64 bb_between(enum square square1, enum square square2)
 	return between[square1][square2];
 }
 
+/* The whole line through both squares, empty if they are not aligned. */
+u64 bb_line(enum square square1, enum square square2)
+{
+	return line[square1][square2];
+}
+
 int bb_distance(enum square square1, enum square square2)
 {
 	return distance[square1][square2];
@@ -35,6 +35,8 @@ void evaluate_init(void) {}
 
 #else
 
+#include <threads.h>
+
 #include "knur.h"
 #include "transposition.h"
 
@@ -259,7 +261,7 @@ static u64 mask_passed[64];
 static u64 mask_center_pawn;
 static u64 mask_center = (BB_RANK_4 | BB_RANK_5) & (BB_FILE_D | BB_FILE_E);
 
-static int pawn_cnt[2];
+static thread_local int pawn_cnt[2];
 
 int eval_pawns(const struct position *pos, const enum color side)
 {
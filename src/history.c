@@ -16,17 +16,26 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <string.h>
+
 #include "knur.h"
 #include "history.h"
+#include "search.h"
 
-struct history history;
+void history_clear(struct history *history)
+{
+	memset(history, 0, sizeof(*history));
+}
 
-void history_clear(void)
+/* Keeps what earlier searches learned, but lets the new search outweigh it. */
+void history_age(struct history *history)
 {
-	memset(&history, 0, sizeof(history));
+	int16_t *score = &history->hh[0][0][0];
+	for (size_t i = 0; i < sizeof(history->hh) / sizeof(*score); i++)
+		score[i] /= 2;
 }
 
-void history_update(struct position *pos, struct search_stack *ss, enum move move, int depth)
+void history_update(struct history *history, struct position *pos, struct search_stack *ss, enum move move, int depth)
 {
 	int delta;
 	int16_t *score;
@@ -41,12 +50,12 @@ void history_update(struct position *pos, struct search_stack *ss, enum move mov
 	/* countermove heuristic */
 	if (prev != MOVE_NONE && prev != MOVE_NULL) {
 		prev_to = MOVE_TO(prev);
-		history.cmh[pos->board[prev_to]][prev_to] = move;
+		history->cmh[pos->board[prev_to]][prev_to] = move;
 	}
 
 	/* history heuristic */
 	/* TODO: good/bad moves */
-	score = &(history.hh[pos->stm][from][to]);
+	score = &(history->hh[pos->stm][from][to]);
 	/* NOTE: Formula taken from Ethereal */
 	delta = (depth > 13 ? 32 : 16) * depth * depth + 128 * MAX(depth - 1, 0);
 	*score += delta - *score * ABS(delta) / (1 << 16);
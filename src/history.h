@@ -21,16 +21,17 @@
 
 #include "knur.h"
 #include "position.h"
-#include "search.h"
 
+struct search_stack;
+
+/* Owned by a search thread, so it is never shared between threads. */
 struct history {
 	enum move cmh[12][SQUARE_NB];
 	int16_t hh[COLOR_NB][SQUARE_NB][SQUARE_NB];
 };
 
-extern struct history history;
-
-void history_clear(void);
-void history_update(struct position *position, struct search_stack *search_stack, enum move move, int depth);
+void history_clear(struct history *history);
+void history_age(struct history *history);
+void history_update(struct history *history, struct position *position, struct search_stack *search_stack, enum move move, int depth);
 
 #endif /* KNUR_HISTORY_H_ */
@@ -41,6 +41,7 @@ int main(void)
 
 	uci_loop();
 
+	search_free();
 	tt_free();
 	pht_free();
 	bb_free();
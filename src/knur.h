@@ -36,7 +36,7 @@ enum piece_type {
 };
 
 /* clang-format off */
-enum piece {
+enum piece : uint8_t {
 	WHITE_PAWN,   BLACK_PAWN,
 	WHITE_KNIGHT, BLACK_KNIGHT,
 	WHITE_BISHOP, BLACK_BISHOP,
@@ -34,32 +34,39 @@ INLINE enum move *add_promotions(enum direction dir, enum move *move_list,
 static enum move *castle_moves(enum move *move_list,
 			       const struct position *position);
 static enum move *pawn_moves(enum mg_type mt, enum move *move_list,
-			     const struct position *position, u64 target);
+			     const struct position *position, u64 target,
+			     u64 movable);
 static enum move *piece_moves(enum piece_type piece, enum move *move_list,
-			      const struct position *position, u64 target);
+			      const struct position *position, u64 target,
+			      u64 movable);
+static enum move *king_moves(enum move *move_list,
+			     const struct position *position, u64 target);
+static enum move *legal_moves(enum move *move_list,
+			      const struct position *position);
 
+/* Only legal castles, the squares the king crosses are checked too. */
 enum move *castle_moves(enum move *move_list, const struct position *pos)
 {
-	(void)move_list;
-	(void)pos;
 	const enum color us = pos->stm, them = !us;
 	const enum square ksq = BB_TO_SQUARE(pos->piece[KING] & pos->color[us]);
 	const u64 occ = pos->piece[ALL_PIECES];
 	/* queenside */
 	if ((pos->st->castle & (1 << us)) &&
 	    !(occ & bb_between(ksq - 3, ksq - 1)) &&
-	    !(pos->color[them] & pos_attackers(pos, ksq + WEST)))
+	    !(pos->color[them] & pos_attackers(pos, ksq + WEST)) &&
+	    !(pos->color[them] & pos_attackers(pos, ksq + WEST * 2)))
 		*move_list++ = MAKE_CASTLE(ksq, ksq - 2);
 	/* kingside */
 	if ((pos->st->castle & (4 << us)) &&
 	    !(occ & bb_between(ksq + 1, ksq + 2)) &&
-	    !(pos->color[them] & pos_attackers(pos, ksq + EAST)))
+	    !(pos->color[them] & pos_attackers(pos, ksq + EAST)) &&
+	    !(pos->color[them] & pos_attackers(pos, ksq + EAST * 2)))
 		*move_list++ = MAKE_CASTLE(ksq, ksq + 2);
 	return move_list;
 }
 
 enum move *pawn_moves(enum mg_type mt, enum move *move_list,
-		      const struct position *pos, u64 target)
+		      const struct position *pos, u64 target, u64 movable)
 {
 	const enum color us = pos->stm, them = !us;
 	const enum direction up = us == WHITE ? NORTH : SOUTH;
@@ -68,8 +75,8 @@ enum move *pawn_moves(enum mg_type mt, enum move *move_list,
 	const u64 rank7 = us == WHITE ? BB_RANK_7 : BB_RANK_2;
 	const u64 empty = ~pos->piece[ALL_PIECES] & target;
 	const u64 enemies = pos->color[them] & target;
-	const u64 pawns = pos->piece[PAWN] & pos->color[us] & ~rank7;
-	const u64 promo = pos->piece[PAWN] & pos->color[us] & rank7;
+	const u64 pawns = pos->piece[PAWN] & movable & ~rank7;
+	const u64 promo = pos->piece[PAWN] & movable & rank7;
 	u64 b1, b2;
 	enum square to;
 
@@ -105,11 +112,16 @@ enum move *pawn_moves(enum mg_type mt, enum move *move_list,
 			}
 		}
 
+		/* the rare case where removing both pawns uncovers a
+		 * slider is left to pos_is_legal() */
 		if (pos->st->enpas != SQ_NONE) {
 			for (b1 = pawns & bb_pawn_attacks(them, pos->st->enpas);
-			     b1;)
-				*move_list++ = MAKE_ENPASSANT(bb_poplsb(&b1),
-							      pos->st->enpas);
+			     b1;) {
+				*move_list = MAKE_ENPASSANT(bb_poplsb(&b1),
+							    pos->st->enpas);
+				move_list += mt != MGT_LEGAL ||
+					     pos_is_legal(pos, *move_list);
+			}
 		}
 	}
 
@@ -135,9 +147,9 @@ enum move *pawn_moves(enum mg_type mt, enum move *move_list,
 }
 
 enum move *piece_moves(enum piece_type pt, enum move *move_list,
-		       const struct position *pos, u64 target)
+		       const struct position *pos, u64 target, u64 movable)
 {
-	u64 pieces = pos->piece[pt] & pos->color[pos->stm], attacks;
+	u64 pieces = pos->piece[pt] & movable, attacks;
 	enum square from;
 	while (pieces) {
 		from = bb_poplsb(&pieces);
@@ -148,16 +160,89 @@ enum move *piece_moves(enum piece_type pt, enum move *move_list,
 	return move_list;
 }
 
+/* Only steps to squares which are not attacked, also once the king left its
+ * square, so it does not step along the ray of a slider checking it. */
+enum move *king_moves(enum move *move_list, const struct position *pos,
+		      u64 target)
+{
+	const enum color us = pos->stm, them = !us;
+	const enum square ksq = BB_TO_SQUARE(pos->piece[KING] & pos->color[us]);
+	const u64 occ = pos->piece[ALL_PIECES] ^ BB_FROM_SQUARE(ksq);
+	u64 b = bb_attacks(KING, ksq, 0) & target;
+	enum square to;
+
+	while (b) {
+		to = bb_poplsb(&b);
+		if (!(pos_attackers_occ(pos, to, occ) & pos->color[them]))
+			*move_list++ = MAKE_MOVE(ksq, to);
+	}
+	return move_list;
+}
+
+/* The pinned pieces and the check mask are computed once, so unlike the other
+ * types no move has to be tested with pos_is_legal() afterwards. */
+enum move *legal_moves(enum move *move_list, const struct position *pos)
+{
+	const enum color us = pos->stm;
+	const enum square ksq = BB_TO_SQUARE(pos->piece[KING] & pos->color[us]);
+	const u64 pinned = pos->st->blockers[us] & pos->color[us];
+	u64 target = ~pos->color[us], line, b;
+	enum piece_type pt;
+	enum square sq;
+
+	move_list = king_moves(move_list, pos, target);
+	if (BB_SEVERAL(pos->st->checkers))
+		return move_list;
+
+	/* Pieces pinned to the king stay on the line through it. In check
+	 * they cannot move at all, as the line does not cross the checker's
+	 * ray anywhere but on the king. */
+	for (b = pos->st->checkers ? 0 : pinned; b;) {
+		sq = bb_poplsb(&b);
+		line = bb_line(ksq, sq);
+		pt = PIECE_TYPE(pos->board[sq]);
+		if (pt == PAWN)
+			move_list = pawn_moves(MGT_LEGAL, move_list, pos,
+					       target & line, BB_FROM_SQUARE(sq));
+		else if (pt != KNIGHT)
+			move_list = piece_moves(pt, move_list, pos,
+						target & line, BB_FROM_SQUARE(sq));
+	}
+
+	if (pos->st->checkers)
+		target &= bb_between(ksq, BB_TO_SQUARE(pos->st->checkers));
+	else
+		move_list = castle_moves(move_list, pos);
+
+	b = pos->color[us] & ~pinned;
+	move_list = pawn_moves(MGT_LEGAL, move_list, pos, target, b);
+	move_list = piece_moves(KNIGHT, move_list, pos, target, b);
+	move_list = piece_moves(BISHOP, move_list, pos, target, b);
+	move_list = piece_moves(ROOK, move_list, pos, target, b);
+	move_list = piece_moves(QUEEN, move_list, pos, target, b);
+
+	return move_list;
+}
+
 enum move *mg_generate(enum mg_type mt, enum move *move_list,
 		       const struct position *pos)
 {
 	const enum color us = pos->stm, them = !us;
 	const enum square ksq = BB_TO_SQUARE(pos->piece[KING] & pos->color[us]);
+	const u64 ours = pos->color[us];
 	u64 target = mt == MGT_CAPTURES ? pos->color[them]
 		   : mt == MGT_QUIET    ? ~pos->piece[ALL_PIECES]
-					: ~pos->color[us];
+					: ~ours;
+
+	if (mt == MGT_LEGAL)
+		return legal_moves(move_list, pos);
 
-	move_list = piece_moves(KING, move_list, pos, target);
+	/* Evasions are pseudo-legal like the other types, only pinned pieces
+	 * are left to pos_is_legal(). */
+	if (mt == MGT_EVASIONS)
+		move_list = king_moves(move_list, pos, target);
+	else
+		move_list = piece_moves(KING, move_list, pos, target, ours);
 	if (BB_SEVERAL(pos->st->checkers))
 		return move_list;
 
@@ -165,12 +250,12 @@ enum move *mg_generate(enum mg_type mt, enum move *move_list,
 		target &= bb_between(ksq, BB_TO_SQUARE(pos->st->checkers));
 	else if (mt != MGT_CAPTURES)
 		move_list = castle_moves(move_list, pos);
-	move_list = pawn_moves(mt, move_list, pos, target);
+	move_list = pawn_moves(mt, move_list, pos, target, ours);
 	if (mt != MGT_SPECIAL) {
-		move_list = piece_moves(KNIGHT, move_list, pos, target);
-		move_list = piece_moves(BISHOP, move_list, pos, target);
-		move_list = piece_moves(ROOK, move_list, pos, target);
-		move_list = piece_moves(QUEEN, move_list, pos, target);
+		move_list = piece_moves(KNIGHT, move_list, pos, target, ours);
+		move_list = piece_moves(BISHOP, move_list, pos, target, ours);
+		move_list = piece_moves(ROOK, move_list, pos, target, ours);
+		move_list = piece_moves(QUEEN, move_list, pos, target, ours);
 	}
 
 	return move_list;
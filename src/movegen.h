@@ -27,6 +27,8 @@ enum mg_type {
 	MGT_CAPTURES,
 	MGT_QUIET,
 	MGT_SPECIAL,
+	MGT_LEGAL,    /* all legal moves */
+	MGT_EVASIONS, /* moves which may get out of check, only when in check */
 };
 
 enum move *mg_generate(enum mg_type mt, enum move *move_list,
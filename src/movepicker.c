@@ -27,6 +27,7 @@
 static int see(struct position *position, enum move move);
 static void score_captures(struct move_picker *move_picker, struct position *position);
 static void score_quiets(struct move_picker *move_picker, struct position *position);
+static void score_evasions(struct move_picker *move_picker, struct position *position);
 static void sort_moves(struct move_picker *move_picker, enum move *begin, enum move *end);
 
 static const int mvv[PIECE_TYPE_NB] = {100, 300, 315, 500, 900, 20000, 0};
@@ -89,14 +90,34 @@ void score_quiets(struct move_picker *mp, struct position *pos)
 	for (m = mp->moves; m != mp->quiets; m++) {
 		from = MOVE_FROM(*m);
 		to = MOVE_TO(*m);
-		mp->scores[m - mp->moves] = history.hh[pos->stm][from][to];
+		mp->scores[m - mp->moves] = mp->history->hh[pos->stm][from][to];
+	}
+}
+
+/* Captures of the checker first, by MVV-LVA, then the other evasions by
+ * history. */
+void score_evasions(struct move_picker *mp, struct position *pos)
+{
+	enum move *m;
+	enum square from, to;
+
+	for (m = mp->moves; m != mp->quiets; m++) {
+		from = MOVE_FROM(*m);
+		to = MOVE_TO(*m);
+		if (pos_is_quiet(pos, *m))
+			mp->scores[m - mp->moves] =
+			    MIN(mp->history->hh[pos->stm][from][to], 31999);
+		else
+			mp->scores[m - mp->moves] =
+			    32000 + mvv[PIECE_TYPE(pos->board[to])] / 4 -
+			    (int)PIECE_TYPE(pos->board[from]);
 	}
 }
 
 void sort_moves(struct move_picker *mp, enum move *begin, enum move *end)
 {
 	enum move *mit, *m, mtmp;
-	int *sit = mp->scores + (begin - mp->moves) + 1, *s, stmp;
+	int16_t *sit = mp->scores + (begin - mp->moves) + 1, *s, stmp;
 	for (mit = begin + 1; mit < end; mit++, sit++) {
 		mtmp = *mit;
 		stmp = *sit;
@@ -109,29 +130,37 @@ void sort_moves(struct move_picker *mp, enum move *begin, enum move *end)
 	}
 }
 
-void mp_init(struct move_picker *mp, struct position *pos, enum move hashmove,
+void mp_init(struct move_picker *mp, struct position *pos,
+	     const struct history *history, enum move hashmove,
 	     struct search_stack *ss)
 {
 	enum square prev_to;
 
-	mp->stage = MP_STAGE_HASH + !pos_is_pseudo_legal(pos, hashmove);
+	mp->stage = pos_is_pseudo_legal(pos, hashmove) ? MP_STAGE_HASH
+		  : pos->st->checkers		      ? MP_STAGE_GENERATE_EVASIONS
+						      : MP_STAGE_GENERATE_CAPTURES;
 	mp->hashmove = hashmove;
 	mp->killer[0] = ss->killer[0];
 	mp->killer[1] = ss->killer[1];
+	mp->history = history;
+	mp->deferred_nb = mp->deferred_idx = 0;
 
 	prev_to = (ss - 1)->move != MOVE_NONE && (ss - 1)->move != MOVE_NULL
 		    ? MOVE_TO((ss - 1)->move)
 		    : SQ_NONE;
-	mp->counter = prev_to == SQ_NONE ? MOVE_NONE : history.cmh[pos->board[prev_to]][prev_to];
+	mp->counter = prev_to == SQ_NONE ? MOVE_NONE : history->cmh[pos->board[prev_to]][prev_to];
 }
 
 enum move mp_next(struct move_picker *mp, struct position *pos, bool skip_quiet)
 {
 	enum move bestmove = MOVE_NONE;
 
+	mp->refutation = false;
 	switch (mp->stage) {
 	case MP_STAGE_HASH:
-		mp->stage = MP_STAGE_GENERATE_CAPTURES;
+		mp->stage = pos->st->checkers ? MP_STAGE_GENERATE_EVASIONS
+					      : MP_STAGE_GENERATE_CAPTURES;
+		mp->refutation = true;
 		return mp->hashmove;
 	case MP_STAGE_GENERATE_CAPTURES:
 		mp->captures = mg_generate(MGT_CAPTURES, mp->moves, pos);
@@ -148,7 +177,7 @@ enum move mp_next(struct move_picker *mp, struct position *pos, bool skip_quiet)
 			return bestmove;
 		}
 		if (skip_quiet) {
-			mp->stage = MP_STAGE_DONE;
+			mp->stage = MP_STAGE_DEFERRED;
 			return mp_next(mp, pos, skip_quiet);
 		}
 		mp->stage = MP_STAGE_KILLER1;
@@ -156,22 +185,28 @@ enum move mp_next(struct move_picker *mp, struct position *pos, bool skip_quiet)
 	case MP_STAGE_KILLER1:
 		mp->stage = MP_STAGE_KILLER2;
 		if (!skip_quiet && mp->killer[0] != mp->hashmove &&
-		    pos_is_pseudo_legal(pos, mp->killer[0]))
+		    pos_is_pseudo_legal(pos, mp->killer[0])) {
+			mp->refutation = true;
 			return mp->killer[0];
+		}
 		[[fallthrough]];
 	case MP_STAGE_KILLER2:
 		mp->stage = MP_STAGE_COUNTER;
 		if (!skip_quiet && mp->killer[1] != mp->hashmove &&
-		    pos_is_pseudo_legal(pos, mp->killer[1]))
+		    pos_is_pseudo_legal(pos, mp->killer[1])) {
+			mp->refutation = true;
 			return mp->killer[1];
+		}
 		[[fallthrough]];
 	case MP_STAGE_COUNTER:
 		mp->stage = MP_STAGE_GENERATE_QUIET;
 		if (!skip_quiet && mp->counter != mp->hashmove &&
 		    mp->counter != mp->killer[0] &&
 		    mp->counter != mp->killer[1] &&
-		    pos_is_pseudo_legal(pos, mp->counter))
+		    pos_is_pseudo_legal(pos, mp->counter)) {
+			mp->refutation = true;
 			return mp->counter;
+		}
 		[[fallthrough]];
 	case MP_STAGE_GENERATE_QUIET:
 		if (!skip_quiet) {
@@ -200,6 +235,33 @@ enum move mp_next(struct move_picker *mp, struct position *pos, bool skip_quiet)
 				continue;
 			return bestmove;
 		}
+		mp->stage = MP_STAGE_DEFERRED;
+		return mp_next(mp, pos, skip_quiet);
+	case MP_STAGE_GENERATE_EVASIONS:
+		mp->quiets = mg_generate(MGT_EVASIONS, mp->moves, pos);
+		score_evasions(mp, pos);
+		sort_moves(mp, mp->moves, mp->quiets);
+		mp->stage = MP_STAGE_EVASIONS;
+		[[fallthrough]];
+	case MP_STAGE_EVASIONS:
+		while (mp->quiets != mp->moves) {
+			bestmove = *--mp->quiets;
+			if (bestmove == mp->hashmove ||
+			    (skip_quiet && pos_is_quiet(pos, bestmove)))
+				continue;
+			/* the evasions include the killers and the counter */
+			mp->refutation = bestmove == mp->killer[0] ||
+					 bestmove == mp->killer[1] ||
+					 bestmove == mp->counter;
+			return bestmove;
+		}
+		mp->stage = MP_STAGE_DEFERRED;
+		[[fallthrough]];
+	case MP_STAGE_DEFERRED:
+		if (mp->deferred_idx < mp->deferred_nb) {
+			mp->refutation = mp->deferred_refutation[mp->deferred_idx];
+			return mp->deferred[mp->deferred_idx++];
+		}
 		mp->stage = MP_STAGE_DONE;
 		[[fallthrough]];
 	case MP_STAGE_DONE: [[fallthrough]];
@@ -19,9 +19,12 @@
 #ifndef KNUR_MOVEPICKER_H_
 #define KNUR_MOVEPICKER_H_
 
+#include "history.h"
 #include "knur.h"
 #include "position.h"
-#include "search.h"
+#include "util.h"
+
+struct search_stack;
 
 enum mp_stage {
 	MP_STAGE_HASH,
@@ -33,20 +36,40 @@ enum mp_stage {
 	MP_STAGE_GENERATE_QUIET,
 	MP_STAGE_QUIET,
 	MP_STAGE_BAD_CAPTURES,
+	MP_STAGE_GENERATE_EVASIONS,
+	MP_STAGE_EVASIONS,
+	MP_STAGE_DEFERRED,
 	MP_STAGE_DONE,
 };
 
 struct move_picker {
 	enum mp_stage stage;
-	int scores[256]; /* move scores */
+	int16_t scores[256]; /* move scores, SEE or history */
 	enum move moves[256];
 	enum move *captures, *quiets;
 	enum move hashmove;
 	enum move killer[2];
 	enum move counter;
+	const struct history *history;
+	bool refutation; /* the last move is the hash move, a killer or the counter */
+	enum move deferred[32]; /* moves put off until all others were tried */
+	bool deferred_refutation[32]; /* [deferred index] refutation of the move */
+	int deferred_nb, deferred_idx;
 };
 
-void mp_init(struct move_picker *mp, struct position *position, enum move hashmove, struct search_stack *search_stack);
+void mp_init(struct move_picker *mp, struct position *position, const struct history *history, enum move hashmove, struct search_stack *search_stack);
 enum move mp_next(struct move_picker *mp, struct position *position, bool skip_quiet);
 
+/* Returns the move again after all the other moves, unless it already was
+ * deferred once or there is no room left. Expects the last move returned. */
+INLINE bool mp_defer(struct move_picker *mp, enum move move)
+{
+	if (mp->stage == MP_STAGE_DEFERRED ||
+	    mp->deferred_nb == (int)ARRAY_SIZE(mp->deferred))
+		return false;
+	mp->deferred_refutation[mp->deferred_nb] = mp->refutation;
+	mp->deferred[mp->deferred_nb++] = move;
+	return true;
+}
+
 #endif /* KNUR_MOVEPICKER_H_ */
@@ -30,11 +30,9 @@ void perft(struct position *pos, int depth)
 	enum move move_list[256], *m, *last;
 	size_t nodes_searched = 0, nodes;
 
-	last = mg_generate(MGT_ALL, move_list, pos);
+	last = mg_generate(MGT_LEGAL, move_list, pos);
 
 	for (m = move_list; m != last; m++) {
-		if (!pos_is_legal(pos, *m))
-			continue;
 		pos_do_move(pos, *m);
 		nodes_searched += nodes = perft_helper(pos, depth - 1);
 		pos_undo_move(pos, *m);
@@ -53,17 +51,12 @@ size_t perft_helper(struct position *pos, int depth)
 	if (depth == 0)
 		return 1;
 
-	last = mg_generate(MGT_ALL, move_list, pos);
+	last = mg_generate(MGT_LEGAL, move_list, pos);
 
-	if (depth == 1) {
-		for (m = move_list; m != last; m++)
-			nodes += pos_is_legal(pos, *m);
-		return nodes;
-	}
+	if (depth == 1)
+		return last - move_list;
 
 	for (m = move_list; m != last; m++) {
-		if (!pos_is_legal(pos, *m))
-			continue;
 		pos_do_move(pos, *m);
 		nodes += perft_helper(pos, depth - 1);
 		pos_undo_move(pos, *m);
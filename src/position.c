@@ -33,8 +33,14 @@ INLINE void add_enpas(struct position *position, enum square square);
 INLINE void add_piece(struct position *position, enum piece piece, enum square square);
 INLINE void del_enpas(struct position *position);
 INLINE void del_piece(struct position *position, enum piece piece, enum square square);
+INLINE void move_piece(struct position *position, enum piece piece, enum square from, enum square to);
 INLINE void flip_stm(struct position *position);
 INLINE void update_castle(struct position *pos, enum square from, enum square to);
+static void set_check_info(struct position *pos);
+static u64 discovered_checkers(const struct position *pos, enum color us, u64 occ);
+#if USE_NNUE
+INLINE void acc_do_move(struct position *pos, enum move move, enum piece piece, enum piece captured);
+#endif
 
 static struct {
 	u64 piece_square[PIECE_NB][SQUARE_NB]; /* [piece][square] */
@@ -83,6 +89,23 @@ void del_piece(struct position *pos, enum piece pc, enum square sq)
 	pos->board[sq] = NO_PIECE;
 }
 
+void move_piece(struct position *pos, enum piece pc, enum square from, enum square to)
+{
+	const u64 from_to = BB_FROM_SQUARE(from) | BB_FROM_SQUARE(to);
+
+	pos->key ^= zobrist.piece_square[pc][from] ^ zobrist.piece_square[pc][to];
+#if !USE_NNUE
+	if (PIECE_TYPE(pc) == PAWN)
+		pos->pawn_key ^= zobrist.piece_square[pc][from] ^
+				 zobrist.piece_square[pc][to];
+#endif
+	pos->color[PIECE_COLOR(pc)] ^= from_to;
+	pos->piece[PIECE_TYPE(pc)] ^= from_to;
+	pos->piece[ALL_PIECES] ^= from_to;
+	pos->board[from] = NO_PIECE;
+	pos->board[to] = pc;
+}
+
 void flip_stm(struct position *pos)
 {
 	pos->key ^= zobrist.side;
@@ -91,7 +114,7 @@ void flip_stm(struct position *pos)
 
 void update_castle(struct position *pos, enum square from, enum square to)
 {
-	static const int castling_table[64] = {
+	static const uint8_t castling_table[64] = {
 	    13, 15, 15, 15, 5,  15, 15, 7,  15, 15, 15, 15, 15, 15, 15, 15,
 	    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
 	    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
@@ -103,6 +126,97 @@ void update_castle(struct position *pos, enum square from, enum square to)
 	pos->key ^= zobrist.castle[pos->st->castle];
 }
 
+/* Everything derived from the placement which the move generator, the legality
+ * test and pos_do_move() need, computed once per position. */
+void set_check_info(struct position *pos)
+{
+	const enum color them = !pos->stm;
+	const u64 occ = pos->piece[ALL_PIECES];
+	struct position_state *st = pos->st;
+	enum square ksq, sq;
+	enum color c;
+	u64 snipers, b;
+
+	for (c = WHITE; c <= BLACK; c++) {
+		ksq = BB_TO_SQUARE(pos->piece[KING] & pos->color[c]);
+		st->blockers[c] = st->pinners[c] = 0;
+		snipers = ((bb_attacks(ROOK, ksq, 0) &
+			    (pos->piece[ROOK] | pos->piece[QUEEN])) |
+			   (bb_attacks(BISHOP, ksq, 0) &
+			    (pos->piece[BISHOP] | pos->piece[QUEEN]))) &
+			  pos->color[!c];
+		while (snipers) {
+			sq = bb_poplsb(&snipers);
+			b = bb_between(ksq, sq) & occ & ~BB_FROM_SQUARE(ksq) &
+			    ~BB_FROM_SQUARE(sq);
+			if (b && !BB_SEVERAL(b)) {
+				st->blockers[c] |= b;
+				BB_SET(st->pinners[c], sq);
+			}
+		}
+	}
+
+	ksq = BB_TO_SQUARE(pos->piece[KING] & pos->color[them]);
+	st->check_squares[PAWN] = bb_pawn_attacks(them, ksq);
+	st->check_squares[KNIGHT] = bb_attacks(KNIGHT, ksq, occ);
+	st->check_squares[BISHOP] = bb_attacks(BISHOP, ksq, occ);
+	st->check_squares[ROOK] = bb_attacks(ROOK, ksq, occ);
+	st->check_squares[QUEEN] = st->check_squares[BISHOP] |
+				   st->check_squares[ROOK];
+	st->check_squares[KING] = 0;
+}
+
+/* Sliders of us attacking the enemy king through occ. */
+u64 discovered_checkers(const struct position *pos, enum color us, u64 occ)
+{
+	const enum square ksq = BB_TO_SQUARE(pos->piece[KING] & pos->color[!us]);
+
+	return ((bb_attacks(ROOK, ksq, occ) &
+		 (pos->piece[ROOK] | pos->piece[QUEEN])) |
+		(bb_attacks(BISHOP, ksq, occ) &
+		 (pos->piece[BISHOP] | pos->piece[QUEEN]))) &
+	       pos->color[us];
+}
+
+#if USE_NNUE
+/* Updates a copy of the accumulator, called after the board is updated. */
+void acc_do_move(struct position *pos, enum move m, enum piece pc, enum piece captured)
+{
+	const enum color us = PIECE_COLOR(pc);
+	const enum square from = MOVE_FROM(m), to = MOVE_TO(m);
+	struct accumulator *acc = pos->acc + 1;
+
+	*acc = *pos->acc;
+	pos->acc = acc;
+
+	if (captured != NO_PIECE)
+		acc_sub(acc, captured, to);
+	acc_sub(acc, pc, from);
+
+	switch (MOVE_TYPE(m)) {
+	case MT_PROMOTION:
+		acc_add(acc, PIECE_MAKE(MOVE_PROMOTION(m), us), to);
+		break;
+	case MT_ENPASSANT:
+		acc_add(acc, pc, to);
+		acc_sub(acc, PIECE_MAKE(PAWN, !us), to + (us == WHITE ? SOUTH : NORTH));
+		break;
+	case MT_CASTLE:
+		acc_add(acc, pc, to);
+		if (to < from) { /* queenside (long) */
+			acc_sub(acc, PIECE_MAKE(ROOK, us), to + 2 * WEST);
+			acc_add(acc, PIECE_MAKE(ROOK, us), to + EAST);
+		} else { /* kingside (short) */
+			acc_sub(acc, PIECE_MAKE(ROOK, us), to + EAST);
+			acc_add(acc, PIECE_MAKE(ROOK, us), to + WEST);
+		}
+		break;
+	default:
+		acc_add(acc, pc, to);
+	}
+}
+#endif
+
 void pos_init(void)
 {
 	unsigned i, j;
@@ -121,8 +235,6 @@ void pos_set_fen(struct position *pos, const char *fen)
 	char c, *str, *saveptr = nullptr, *token;
 	enum square sq;
 	enum color color;
-	[[maybe_unused]] u64 occ;
-
 	memset(pos, 0, sizeof(struct position));
 
 	fen = fen == nullptr ? START_FEN : fen;
@@ -208,18 +320,42 @@ void pos_set_fen(struct position *pos, const char *fen)
 	    pos_attackers(
 		pos, BB_TO_SQUARE(pos->piece[KING] & pos->color[pos->stm])) &
 	    pos->color[!pos->stm];
+	set_check_info(pos);
 
 	free(str);
+}
+
+/* Copies the board, the current state and the part of the game history which
+ * can still decide a repetition. The copy has no accumulator. */
+void pos_copy(struct position *dst, const struct position *src)
+{
+	int first = MAX(0, src->game_ply - src->st->fifty_rule - 2);
 
+	memcpy(dst, src, offsetof(struct position, reps));
+	memcpy(dst->reps + first, src->reps + first,
+	       (src->game_ply - first) * sizeof(u64));
+	dst->state_stack[0] = *src->st;
+	dst->st = dst->state_stack;
 #if USE_NNUE
-	pos->acc = pos->accumulator_stack;
-	acc_init(pos->acc);
-	for (occ = pos->piece[ALL_PIECES]; occ; ) {
+	dst->acc = nullptr;
+#endif
+}
+
+#if USE_NNUE
+/* Computes the accumulator from scratch, moves push their updates after it. */
+void pos_set_acc(struct position *pos, struct accumulator *acc)
+{
+	u64 occ;
+	enum square sq;
+
+	pos->acc = acc;
+	acc_init(acc);
+	for (occ = pos->piece[ALL_PIECES]; occ;) {
 		sq = bb_poplsb(&occ);
-		acc_add(pos->acc, pos->board[sq], sq);
+		acc_add(acc, pos->board[sq], sq);
 	}
-#endif
 }
+#endif
 
 void pos_print(const struct position *pos)
 {
@@ -255,33 +391,21 @@ void pos_do_move(struct position *pos, enum move m)
 	const enum direction up = us == WHITE ? NORTH : SOUTH;
 	const enum square from = MOVE_FROM(m), to = MOVE_TO(m);
 	const enum piece pc = pos->board[from], captured = pos->board[to];
+	const struct position_state *prev = pos->st;
 	struct position_state *st = pos->st + 1;
 
-#if USE_NNUE
-	struct accumulator *acc = pos->acc + 1;
-	*acc = *pos->acc;
-	pos->acc = acc;
-#endif
-
-	*st = *(pos->st);
-	st->fifty_rule++;
+	/* the rest of the state is computed below */
+	st->enpas = prev->enpas;
+	st->castle = prev->castle;
+	st->fifty_rule = prev->fifty_rule + 1;
 	if (PIECE_TYPE(pc) == PAWN || captured != NO_PIECE)
 		st->fifty_rule = 0;
 	st->captured = captured;
 	pos->st = st;
 
-	if (captured != NO_PIECE) {
+	if (captured != NO_PIECE)
 		del_piece(pos, captured, to);
-#if USE_NNUE
-		acc_sub(pos->acc, captured, to);
-#endif
-	}
-	del_piece(pos, pc, from);
-	add_piece(pos, pc, to);
-#if USE_NNUE
-	acc_sub(pos->acc, pc, from);
-	acc_add(pos->acc, pc, to);
-#endif
+	move_piece(pos, pc, from, to);
 
 	del_enpas(pos);
 
@@ -293,43 +417,48 @@ void pos_do_move(struct position *pos, enum move m)
 		} else if (MOVE_TYPE(m) == MT_PROMOTION) {
 			del_piece(pos, pc, to);
 			add_piece(pos, PIECE_MAKE(MOVE_PROMOTION(m), us), to);
-#if USE_NNUE
-			acc_sub(pos->acc, pc, to);
-			acc_add(pos->acc, PIECE_MAKE(MOVE_PROMOTION(m), us), to);
-#endif
 		} else if (MOVE_TYPE(m) == MT_ENPASSANT) {
 			del_piece(pos, PIECE_MAKE(PAWN, them), to - up);
-#if USE_NNUE
-			acc_sub(pos->acc, PIECE_MAKE(PAWN, them), to - up);
-#endif
 		}
 	} else if (PIECE_TYPE(pc) == KING) {
 		if (MOVE_TYPE(m) == MT_CASTLE) {
 			if (to < from) { /* queenside (long) */
-				del_piece(pos, PIECE_MAKE(ROOK, us), to + 2 * WEST);
-				add_piece(pos, PIECE_MAKE(ROOK, us), to + EAST);
-#if USE_NNUE
-				acc_sub(pos->acc, PIECE_MAKE(ROOK, us), to + 2 * WEST);
-				acc_add(pos->acc, PIECE_MAKE(ROOK, us), to + EAST);
-#endif
+				move_piece(pos, PIECE_MAKE(ROOK, us), to + 2 * WEST,
+					   to + EAST);
 			} else { /* kingside (short) */
-				del_piece(pos, PIECE_MAKE(ROOK, us), to + EAST);
-				add_piece(pos, PIECE_MAKE(ROOK, us), to + WEST);
-#if USE_NNUE
-				acc_sub(pos->acc, PIECE_MAKE(ROOK, us), to + EAST);
-				acc_add(pos->acc, PIECE_MAKE(ROOK, us), to + WEST);
-#endif
+				move_piece(pos, PIECE_MAKE(ROOK, us), to + EAST,
+					   to + WEST);
 			}
 		}
 	}
 
-	/* TODO: optimize */
-	pos->st->checkers = pos_attackers(pos, BB_TO_SQUARE(pos->piece[KING] &
-							    pos->color[them])) &
-			    pos->color[us];
+#if USE_NNUE
+	/* only positions which get evaluated carry an accumulator */
+	if (pos->acc)
+		acc_do_move(pos, m, pc, captured);
+#endif
+
+	/* Direct checks come from the check squares of the previous position,
+	 * discovered ones from its blockers. Special moves are rare enough to
+	 * just look at the king. */
+	if (MOVE_TYPE(m) != MT_NORMAL) {
+		st->checkers = pos_attackers(pos, BB_TO_SQUARE(pos->piece[KING] &
+							       pos->color[them])) &
+			       pos->color[us];
+	} else {
+		st->checkers = prev->check_squares[PIECE_TYPE(pc)] &
+			       BB_FROM_SQUARE(to);
+		if (BB_TEST(prev->blockers[them], from) &&
+		    !BB_TEST(bb_line(from, BB_TO_SQUARE(pos->piece[KING] &
+							pos->color[them])),
+			     to))
+			st->checkers |= discovered_checkers(
+			    pos, us, pos->piece[ALL_PIECES]);
+	}
 
 	flip_stm(pos);
 	update_castle(pos, from, to);
+	set_check_info(pos);
 
 	pos->reps[pos->game_ply++] = pos->key;
 }
@@ -359,17 +488,16 @@ void pos_undo_move(struct position *pos, enum move m)
 	} else if (PIECE_TYPE(pc) == KING) {
 		if (MOVE_TYPE(m) == MT_CASTLE) {
 			if (to < from) { /* queenside (long) */
-				del_piece(pos, PIECE_MAKE(ROOK, us), to + EAST);
-				add_piece(pos, PIECE_MAKE(ROOK, us), to + 2 * WEST);
+				move_piece(pos, PIECE_MAKE(ROOK, us), to + EAST,
+					   to + 2 * WEST);
 			} else { /* kingside (short) */
-				del_piece(pos, PIECE_MAKE(ROOK, us), to + WEST);
-				add_piece(pos, PIECE_MAKE(ROOK, us), to + EAST);
+				move_piece(pos, PIECE_MAKE(ROOK, us), to + WEST,
+					   to + EAST);
 			}
 		}
 	}
 
-	del_piece(pos, pc, to);
-	add_piece(pos, pc, from);
+	move_piece(pos, pc, to, from);
 
 	if (captured != NO_PIECE)
 		add_piece(pos, captured, to);
@@ -381,21 +509,28 @@ void pos_undo_move(struct position *pos, enum move m)
 
 	pos->game_ply--;
 
-	pos->acc--;
+#if USE_NNUE
+	if (pos->acc)
+		pos->acc--;
+#endif
 }
 
 void pos_do_null_move(struct position *pos)
 {
+	const struct position_state *prev = pos->st;
 	struct position_state *st = pos->st + 1;
 
-	*st = *(pos->st);
-	st->fifty_rule++;
+	st->enpas = prev->enpas;
+	st->castle = prev->castle;
+	st->fifty_rule = prev->fifty_rule + 1;
+	st->captured = NO_PIECE;
 	pos->st = st;
 
 	del_enpas(pos);
 
 	pos->st->checkers = 0;
 	flip_stm(pos);
+	set_check_info(pos);
 
 	pos->reps[pos->game_ply++] = pos->key;
 }
@@ -443,17 +578,20 @@ bool pos_is_legal(const struct position *pos, enum move m)
 	if (ksq == from)
 		return !(pos_attackers_occ(pos, to, occ) & enemies);
 
+	/* en passant removes two pieces from the board */
 	if (MOVE_TYPE(m) == MT_ENPASSANT) {
 		BB_XOR(enemies, to + down);
 		BB_XOR(occ, to + down);
+		return !(((bb_attacks(ROOK, ksq, occ) &
+			   (pos->piece[ROOK] | pos->piece[QUEEN])) |
+			  (bb_attacks(BISHOP, ksq, occ) &
+			   (pos->piece[BISHOP] | pos->piece[QUEEN]))) &
+			 enemies);
 	}
 
-	/* check for discovered checks */
-	return !(((bb_attacks(ROOK, ksq, occ) &
-		   (pos->piece[ROOK] | pos->piece[QUEEN])) |
-		  (bb_attacks(BISHOP, ksq, occ) &
-		   (pos->piece[BISHOP] | pos->piece[QUEEN]))) &
-		 enemies);
+	/* a pinned piece has to stay on the line to its king */
+	return !BB_TEST(pos->st->blockers[us], from) ||
+	       BB_TEST(bb_line(from, ksq), to);
 }
 
 bool pos_is_pseudo_legal(const struct position *pos, enum move m)
@@ -463,18 +601,37 @@ bool pos_is_pseudo_legal(const struct position *pos, enum move m)
 		    ksq = BB_TO_SQUARE(pos->piece[KING] & pos->color[us]);
 	enum piece pc = pos->board[from];
 	enum direction up = us == WHITE ? NORTH : SOUTH;
-	enum move move_list[256], *last;
+	enum direction dir = to < from ? WEST : EAST;
+	u64 occ = pos->piece[ALL_PIECES];
 
 	if (m == MOVE_NONE || pc == NO_PIECE || PIECE_COLOR(pc) != us ||
 	    BB_TEST(pos->piece[ALL_PIECES] & pos->color[us], to))
 		return false;
 
-	if (MOVE_TYPE(m) != MT_NORMAL) {
-		last = mg_generate(MGT_SPECIAL, move_list, pos);
-		while (last-- != move_list)
-			if (*last == m)
-				return true;
-		return false;
+	/* The special moves are checked the way the move generator makes
+	 * them, castles are fully legal then. */
+	switch (MOVE_TYPE(m)) {
+	case MT_CASTLE:
+		return PIECE_TYPE(pc) == KING && !pos->st->checkers &&
+		       to == from + 2 * dir &&
+		       (pos->st->castle & (dir == WEST ? 1 << us : 4 << us)) &&
+		       !(occ & bb_between(from + dir, dir == WEST ? from + 3 * dir
+								  : to)) &&
+		       !(pos->color[them] & pos_attackers(pos, from + dir)) &&
+		       !(pos->color[them] & pos_attackers(pos, to));
+	case MT_ENPASSANT:
+		return PIECE_TYPE(pc) == PAWN && to == pos->st->enpas &&
+		       BB_TEST(bb_pawn_attacks(us, from), to);
+	case MT_PROMOTION:
+		if (PIECE_TYPE(pc) != PAWN ||
+		    SQ_RANK(to) != (us == WHITE ? 0 : 7) ||
+		    !((from + up == to && pos->board[to] == NO_PIECE) ||
+		      BB_TEST(bb_pawn_attacks(us, from) & pos->color[them], to)))
+			return false;
+		return !pos->st->checkers ||
+		       (!BB_SEVERAL(pos->st->checkers) &&
+			BB_TEST(bb_between(ksq, BB_LSB(pos->st->checkers)), to));
+	case MT_NORMAL: break;
 	}
 
 	if (PIECE_TYPE(pc) == PAWN) {
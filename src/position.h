@@ -24,38 +24,48 @@
 #include "nnue.h"
 #endif
 
+/* Only enpas, fifty_rule and castle carry over to the next state, the rest
+ * is set by every move. */
 struct position_state {
 	enum square enpas;   /* enpassant square */
-	int castle;          /* castling rights */
-	int fifty_rule;      /* fifty move rule */
+	uint16_t fifty_rule; /* fifty move rule */
+	uint8_t castle;      /* castling rights */
 	enum piece captured; /* captured piece */
 	u64 checkers;        /* bitboard of pieces giving a check */
+	u64 blockers[COLOR_NB]; /* [color] lone pieces between the color's king
+				   and an enemy slider, of either color */
+	u64 pinners[COLOR_NB];  /* [color] enemy sliders behind those blockers */
+	u64 check_squares[ALL_PIECES]; /* [piece type] squares from which a
+					  piece of the side to move checks */
 };
 
+/* Ordered by use, what a move touches fits in the first three cache lines. */
 struct position {
-	enum color stm;              /* side to move */
-	u64 color[COLOR_NB];         /* [color] colors' bitboards */
 	u64 piece[PIECE_TYPE_NB];    /* [piece type] piece types' bitboards */
-	enum piece board[SQUARE_NB]; /* [square] piece on each square */
-	int game_ply;                /* game halfmove counter */
-	u64 reps[MAX_MOVES];         /* [game ply] repetition array */
+	u64 color[COLOR_NB];         /* [color] colors' bitboards */
 	u64 key;                     /* zobrist hash */
-#if !USE_NNUE
+	struct position_state *st;   /* position's state */
+#if USE_NNUE
+	struct accumulator *acc; /* position's accumulator, nullptr if none */
+#else
 	u64 pawn_key; /* zobrist hash for pawns */
 #endif
+	enum color stm;              /* side to move */
+	int game_ply;                /* game halfmove counter */
+	enum piece board[SQUARE_NB]; /* [square] piece on each square */
 
+	/* game history, pos_copy() only copies what the search can reach */
+	u64 reps[MAX_MOVES];                          /* [game ply] repetition array */
 	struct position_state state_stack[MAX_MOVES]; /* state stack */
-	struct position_state *st;                    /* position's state */
-
-#if USE_NNUE
-	struct accumulator accumulator_stack[MAX_MOVES]; /* accumulator stack */
-	struct accumulator *acc;                         /* position's accumulator */
-#endif
 };
 
 void pos_init(void);
 
 void pos_set_fen(struct position *position, const char *fen);
+void pos_copy(struct position *destination, const struct position *source);
+#if USE_NNUE
+void pos_set_acc(struct position *position, struct accumulator *accumulator);
+#endif
 void pos_print(const struct position *position);
 
 void pos_do_move(struct position *position, enum move move);
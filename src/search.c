@@ -16,6 +16,9 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
+
+#include <inttypes.h>
 #include <math.h>
 #include <pthread.h>
 #include <setjmp.h>
@@ -24,25 +27,40 @@
 #include <stdlib.h>
 #include <string.h>
 #include <threads.h>
+#include <time.h>
 
 #include "bitboards.h"
 #include "evaluate.h"
 #include "history.h"
 #include "knur.h"
+#include "movegen.h"
 #include "movepicker.h"
 #include "position.h"
 #include "search.h"
 #include "transposition.h"
 #include "util.h"
 
-struct arg {
-	struct position pos;
-	struct search_limits *limits;
-};
-
-static int quiescence(struct position *position, struct search_stack *search_stack, int alpha, int beta);
-static int negamax(struct position *position, struct search_stack *search_stack, int alpha, int beta, int depth, bool cutnode);
-static void *search(void *arg);
+static int quiescence(struct search_thread *thread, struct search_stack *search_stack, int alpha, int beta);
+static int negamax(struct search_thread *thread, struct search_stack *search_stack, int alpha, int beta, int depth, bool cutnode);
+static void search(struct search_thread *thread);
+static struct search_stack *stack_init(struct search_thread *thread);
+static void *idle_loop(void *arg);
+static void thread_wake(struct search_thread *thread);
+static void thread_wait(struct search_thread *thread);
+static void threads_free(void);
+static void *timer_loop(void *arg);
+static void timer_set(u64 deadline);
+static void stop_search(void);
+static void tm_init(void);
+static bool tm_stop(struct search_thread *thread, u64 elapsed, u64 iteration);
+static struct root_move *root_move_find(struct search_thread *thread, enum move move);
+static void root_move_promote(struct search_thread *thread, struct root_move *rm);
+static bool root_move_skip(struct search_thread *thread, enum move move);
+static void print_info(struct search_thread *thread, int depth, int line);
+static void iteration_abort(struct search_thread *thread);
+static void turn_wait(struct search_thread *thread);
+static void turn_pass(struct search_thread *thread, bool leave);
+static u64 search_nodes(void);
 
 struct search_params search_params = {
     .window_depth = 4,
@@ -56,24 +74,135 @@ struct search_params search_params = {
 };
 static struct search_params *sp = &search_params;
 
-static int seldepth;
-static u64 nodes, max_nodes;
-static atomic_bool running = false, thrd_joined = true;
-static u64 stop_time;
-static pthread_t thrd;
-static jmp_buf jbuffer;
+struct search_options search_options = {
+    .move_overhead = SEARCH_DEFAULT_OVERHEAD,
+    .multipv = SEARCH_DEFAULT_MULTIPV,
+    .deterministic = false,
+    .thread_binding = false,
+};
+
+static u64 max_nodes;
+/* The main thread holds back bestmove while the search is running and either
+ * infinite or pondering. running, ponder and ponder_stop only change under
+ * threads[0]->mutex, which the main thread waits on, so a stop or ponderhit
+ * cannot slip in between its test and its wait. Nodes read them unlocked. */
+static atomic_bool running = false;
+static atomic_uint_least64_t stopped_at; /* when the search was told to stop */
+static atomic_bool ponder = false;       /* searching on the opponent's time */
+static atomic_bool ponder_stop = false;  /* time ran out while pondering */
+static struct search_limits *limits;
+static struct position root; /* searched position, the threads' copies move */
+static struct search_thread **threads; /* allocated by the threads themselves */
+static int threads_nb;
 static int lmr_reduction[MAX_PLY][64];
 
-INLINE bool abort_search(void)
+/* Owns the time limit, so the search does not have to poll the clock. */
+static struct {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	u64 deadline; /* gettime() at which to stop, 0 if none */
+	bool exit;
+} timer;
+
+/* Signals search_set_threads() that a new thread has set itself up. */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} spawn = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* Deterministic mode.
+ * The threads search one at a time and hand over every DETERMINISTIC_NODES
+ * nodes in the order of their ids, so they interleave the same way in every
+ * run and a depth or node limited search always gives the same result. */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int turn; /* id of the thread allowed to search */
+} sched = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* The position expected after the opponent answers the previous best move,
+ * and our reply to it from the previous PV. */
+static struct {
+	u64 key;
+	enum move move;
+} expected;
+
+/* Time budget of the current search in ms since limits->start. The hard limit
+ * aborts the search, the soft one only keeps the main thread from starting
+ * another iteration and is scaled by how settled the search looks. */
+static struct {
+	u64 soft;           /* 0 if the iterations may not end early */
+	u64 hard;           /* 0 if there is no time limit */
+	int stability;      /* iterations in a row with the same best move */
+	int value;          /* value of the previous iteration */
+	enum move bestmove; /* best move of the previous iteration */
+} tm;
+
+/* ABDADA.
+ * Children a thread is searching, tagged with the depth of their parent. The
+ * other threads put those moves off until they tried everything else, by which
+ * time the result is usually in the TT. Lost races only cost efficiency. */
+constexpr int BUSY_DEPTH = 5;
+constexpr size_t BUSY_SIZE = 1 << 14;
+static atomic_uint_least64_t busy[BUSY_SIZE];
+
+INLINE bool busy_test(u64 key, int depth)
+{
+	return atomic_load_explicit(&busy[key & (BUSY_SIZE - 1)], memory_order_relaxed) == (key ^ depth);
+}
+
+INLINE bool busy_enter(u64 key, int depth)
+{
+	u64 expected = 0;
+	return atomic_compare_exchange_strong_explicit(&busy[key & (BUSY_SIZE - 1)], &expected, key ^ depth,
+						       memory_order_relaxed, memory_order_relaxed);
+}
+
+INLINE void busy_leave(u64 key)
 {
-	if ((stop_time && nodes % 4096 == 0 && gettime() >= stop_time) ||
-	    (nodes >= max_nodes))
-		running = false;
-	return !running;
+	atomic_store_explicit(&busy[key & (BUSY_SIZE - 1)], 0, memory_order_relaxed);
 }
 
-static int quiescence(struct position *pos, struct search_stack *ss, int alpha, int beta)
+/* Only the thread itself counts its nodes, so the increment needs no atomic
+ * read-modify-write. The relaxed accesses let the others sum the counters. */
+INLINE u64 thread_nodes(struct search_thread *thread)
 {
+	return atomic_load_explicit(&thread->nodes, memory_order_relaxed);
+}
+
+INLINE void thread_node(struct search_thread *thread)
+{
+	atomic_store_explicit(&thread->nodes, thread_nodes(thread) + 1, memory_order_relaxed);
+}
+
+/* The timer thread or the UCI thread clears the flag, nodes just read it.
+ * Only the main thread checks the node limit, and with helpers only every
+ * NODES_CHECK of its nodes, as that sums up the counters of all threads. */
+constexpr u64 NODES_CHECK = 1024;
+
+INLINE bool abort_search(struct search_thread *thread)
+{
+	u64 nodes = thread_nodes(thread);
+
+	if (thread->scheduled && !(nodes % DETERMINISTIC_NODES))
+		turn_pass(thread, false);
+	if (max_nodes && !thread->id &&
+	    (threads_nb == 1 || !(nodes % NODES_CHECK)) &&
+	    search_nodes() >= max_nodes)
+		stop_search();
+	return !atomic_load_explicit(&running, memory_order_relaxed);
+}
+
+static int quiescence(struct search_thread *thread, struct search_stack *ss, int alpha, int beta)
+{
+	struct position *pos = thread->pos;
 	bool pvnode = beta - alpha != 1;
 	bool in_check = !!pos->st->checkers;
 	bool tt_hit;
@@ -85,13 +214,13 @@ static int quiescence(struct position *pos, struct search_stack *ss, int alpha,
 	enum tt_bound tt_bound = TT_NONE;
 	enum move move, bestmove = MOVE_NONE;
 	enum move hashmove = MOVE_NONE;
-	struct move_picker mp;
+	struct move_picker *mp = &ss->mp[0];
 
-	if (abort_search())
-		longjmp(jbuffer, 1);
+	if (abort_search(thread))
+		longjmp(thread->jbuffer, 1);
 
-	seldepth = MAX(seldepth, ss->ply + 1);
-	nodes++;
+	thread->seldepth = MAX(thread->seldepth, ss->ply + 1);
+	thread_node(thread);
 
 	if (pos_is_draw(pos))
 		return 0;
@@ -125,8 +254,8 @@ static int quiescence(struct position *pos, struct search_stack *ss, int alpha,
 	best_value = eval;
 
 move_loop:
-	mp_init(&mp, pos, in_check ? hashmove : MOVE_NONE, ss);
-	while ((move = mp_next(&mp, pos, !in_check)) != MOVE_NONE) {
+	mp_init(mp, pos, &thread->history, in_check ? hashmove : MOVE_NONE, ss);
+	while ((move = mp_next(mp, pos, !in_check)) != MOVE_NONE) {
 		if (!pos_is_legal(pos, move))
 			continue;
 
@@ -135,7 +264,7 @@ move_loop:
 		ss->move = move;
 		pos_do_move(pos, move);
 		tt_prefetch(pos->key);
-		value = -quiescence(pos, ss + 1, -beta, -alpha);
+		value = -quiescence(thread, ss + 1, -beta, -alpha);
 		pos_undo_move(pos, move);
 
 		if (value <= best_value)
@@ -164,12 +293,13 @@ move_loop:
 	return best_value;
 }
 
-int negamax(struct position *pos, struct search_stack *ss, int alpha, int beta, int depth, bool cutnode)
+int negamax(struct search_thread *thread, struct search_stack *ss, int alpha, int beta, int depth, bool cutnode)
 {
+	struct position *pos = thread->pos;
 	bool isroot = !ss->ply;
 	bool pvnode = beta - alpha != 1;
 	bool in_check = !!pos->st->checkers;
-	bool tt_hit, improving, is_quiet, full_search;
+	bool tt_hit, improving, is_quiet, full_search, entered;
 	int value = -CHECKMATE, eval = UNKNOWN;
 	int best_value = -CHECKMATE;
 	int movecount = 0;
@@ -179,10 +309,14 @@ int negamax(struct position *pos, struct search_stack *ss, int alpha, int beta,
 	enum tt_bound tt_bound = TT_NONE;
 	enum move move, bestmove = MOVE_NONE;
 	enum move hashmove = MOVE_NONE;
-	struct move_picker mp;
+	/* the singular search reenters the ply while its picker is in use */
+	struct move_picker *mp = &ss->mp[ss->skip != MOVE_NONE];
+	struct root_move *rm;
+	u64 nodes = 0;
+	bool abdada = threads_nb > 1 && !isroot && depth >= BUSY_DEPTH;
 
 	ss->move = MOVE_NONE;
-	ss->pv[0] = MOVE_NONE;
+	ss->pv_length = 0;
 	ss->dextensions = (ss - 1)->dextensions;
 
 	/* Killer moves are local to a position, so we have to reset them. */
@@ -196,19 +330,19 @@ int negamax(struct position *pos, struct search_stack *ss, int alpha, int beta,
 	if (depth <= 0) {
 		/* don't enter quiescence in check */
 		if (!in_check)
-			return quiescence(pos, ss, alpha, beta);
+			return quiescence(thread, ss, alpha, beta);
 		depth = 1;
 	}
 
 	/* Step 2. Abort Search.
 	 * Exit if time is up or the program has been stopped by a UCI command.
 	 */
-	if (abort_search())
-		longjmp(jbuffer, 1);
+	if (abort_search(thread))
+		longjmp(thread->jbuffer, 1);
 
 	/* Update UCI relevant information */
-	seldepth = MAX(seldepth, ss->ply + 1);
-	nodes++;
+	thread->seldepth = MAX(thread->seldepth, ss->ply + 1);
+	thread_node(thread);
 
 	/* Step 3. Check for early exit conditions.
 	 * Do not exit in the root as we would possibly not get any best move.
@@ -245,8 +379,7 @@ int negamax(struct position *pos, struct search_stack *ss, int alpha, int beta,
 	    hashmove != MOVE_NONE &&
 	    ((tt_bound == TT_EXACT) ||
 	     (tt_bound == TT_UPPER && tt_value <= alpha) ||
-	     (tt_bound == TT_LOWER && tt_value >= beta)) &&
-	    pos_is_pseudo_legal(pos, hashmove) && pos_is_legal(pos, hashmove))
+	     (tt_bound == TT_LOWER && tt_value >= beta)))
 		return tt_value;
 
 	/* Step 5. Internal Iterative deepening.
@@ -255,7 +388,7 @@ int negamax(struct position *pos, struct search_stack *ss, int alpha, int beta,
 	 * best move. At the same time we can get a better eval of the position.
 	 */
 	if (ENABLE_IID && !tt_hit && depth >= 6 && (pvnode || cutnode)) {
-		(void)negamax(pos, ss, alpha, beta, depth * 2 / 3, cutnode);
+		(void)negamax(thread, ss, alpha, beta, depth * 2 / 3, cutnode);
 		tt_hit = tt_probe(pos->key, ss->ply, &tt_depth, &tt_bound, &tt_value, &tt_eval, &hashmove);
 	}
 
@@ -288,7 +421,7 @@ int negamax(struct position *pos, struct search_stack *ss, int alpha, int beta,
 		ss->move = MOVE_NULL;
 		pos_do_null_move(pos);
 		tt_prefetch(pos->key);
-		value = -negamax(pos, ss + 1, -beta, -alpha, depth - R - 1, !cutnode);
+		value = -negamax(thread, ss + 1, -beta, -alpha, depth - R - 1, !cutnode);
 		pos_undo_null_move(pos);
 
 		if (value >= beta)
@@ -317,8 +450,8 @@ int negamax(struct position *pos, struct search_stack *ss, int alpha, int beta,
 	bound = (2.3263 * 149.2298 + beta - -4.060770) / 1.132305;
 	if (ENABLE_PROBCUT && depth >= 6 && !IS_MATE(beta) &&
 	    !(tt_hit && tt_depth >= depth - 3 && tt_value < bound)) {
-		mp_init(&mp, pos, hashmove, ss);
-		while ((move = mp_next(&mp, pos, true)) != MOVE_NONE) {
+		mp_init(mp, pos, &thread->history, hashmove, ss);
+		while ((move = mp_next(mp, pos, true)) != MOVE_NONE) {
 			if (!pos_is_legal(pos, move))
 				continue;
 
@@ -327,9 +460,9 @@ int negamax(struct position *pos, struct search_stack *ss, int alpha, int beta,
 
 			/* TODO: it might be beneficial to validate with
 			 * quiescence only in case of deep searches */
-			value = -quiescence(pos, ss + 1, -bound, -bound + 1);
+			value = -quiescence(thread, ss + 1, -bound, -bound + 1);
 			if (value >= bound)
-				value = -negamax(pos, ss + 1, -bound, -bound + 1, depth - 4, !cutnode);
+				value = -negamax(thread, ss + 1, -bound, -bound + 1, depth - 4, !cutnode);
 
 			pos_undo_move(pos, move);
 
@@ -343,11 +476,14 @@ int negamax(struct position *pos, struct search_stack *ss, int alpha, int beta,
 
 	/* Step 10. Initialize the Move Picker and check possible moves. */
 move_loop:
-	mp_init(&mp, pos, hashmove, ss);
-	while ((move = mp_next(&mp, pos, false)) != MOVE_NONE) {
+	mp_init(mp, pos, &thread->history, hashmove, ss);
+	while ((move = mp_next(mp, pos, false)) != MOVE_NONE) {
 		if (!pos_is_legal(pos, move) || move == ss->skip)
 			continue;
 
+		if (isroot && root_move_skip(thread, move))
+			continue;
+
 		movecount++;
 
 		is_quiet = pos_is_quiet(pos, move);
@@ -358,7 +494,7 @@ move_loop:
 		 * ordering is alright — we can prune other moves.
 		 */
 		if (ENABLE_LMP && !pvnode &&
-		    mp.stage >= MP_STAGE_GENERATE_QUIET &&
+		    mp->stage >= MP_STAGE_GENERATE_QUIET &&
 		    depth <= sp->lmp_depth && !in_check &&
 		    pos_non_pawn(pos, pos->stm) && orig_alpha < alpha &&
 		    movecount >= (3 + depth * depth) / (2 - improving))
@@ -374,7 +510,7 @@ move_loop:
 			bound = MAX(tt_value - depth, -CHECKMATE);
 
 			ss->skip = hashmove;
-			value = negamax(pos, ss, bound - 1, bound, (depth - 1) / 2, cutnode);
+			value = negamax(thread, ss, bound - 1, bound, (depth - 1) / 2, cutnode);
 			ss->skip = MOVE_NONE;
 
 			/* MultiCut.
@@ -396,10 +532,24 @@ move_loop:
 		new_depth = depth + extension;
 		ss->dextensions += extension > 1;
 
+		if (isroot)
+			nodes = thread_nodes(thread);
+
 		ss->move = move;
 		pos_do_move(pos, move);
 		tt_prefetch(pos->key);
 
+		/* Another thread is searching this child, so try the others
+		 * first. The eldest brother is always searched. */
+		if (abdada && movecount > 1 && busy_test(pos->key, depth) &&
+		    mp_defer(mp, move)) {
+			pos_undo_move(pos, move);
+			ss->dextensions -= extension > 1;
+			movecount--;
+			continue;
+		}
+		entered = abdada && busy_enter(pos->key, depth);
+
 		/* Step 13. Late Move Reductions.
 		 * Reduce the depth of search for moves other than the first
 		 * one. This assumes the move ordering is so good that the first
@@ -411,14 +561,14 @@ move_loop:
 				R = lmr_reduction[MIN(depth, MAX_PLY)][MIN(movecount, 64)];
 				R += !pvnode + !improving;
 				R += in_check && PIECE_TYPE(pos->board[MOVE_FROM(move)]) == KING;
-				R -= mp.stage < MP_STAGE_QUIET;
+				R -= mp->refutation;
 
 				/* TODO: adjust based on history scores */
 			}
 
 			R = MAX(1, MIN(depth - 1, R));
 
-			value = -negamax(pos, ss + 1, -(alpha + 1), -alpha, new_depth - R, true);
+			value = -negamax(thread, ss + 1, -(alpha + 1), -alpha, new_depth - R, true);
 
 			/* TODO: adjust research depth based on results */
 
@@ -428,14 +578,36 @@ move_loop:
 		}
 
 		if (full_search)
-			value = -negamax(pos, ss + 1, -(alpha + 1), -alpha, new_depth - 1, !cutnode);
+			value = -negamax(thread, ss + 1, -(alpha + 1), -alpha, new_depth - 1, !cutnode);
 
 		if (pvnode && (movecount == 1 || value > alpha))
-			value = -negamax(pos, ss + 1, -beta, -alpha, new_depth - 1, false);
+			value = -negamax(thread, ss + 1, -beta, -alpha, new_depth - 1, false);
 
+		if (entered)
+			busy_leave(pos->key);
 		pos_undo_move(pos, move);
 		ss->dextensions -= extension > 1;
 
+		/* Root moves are kept as soon as they are searched, so an
+		 * aborted iteration can still use the ones which raised alpha.
+		 */
+		if (isroot) {
+			rm = root_move_find(thread, move);
+			rm->nodes += thread_nodes(thread) - nodes;
+			if (depth == thread->root_depth) {
+				rm->depth = depth;
+				if (value > alpha) {
+					rm->value = value;
+					rm->pv[0] = move;
+					memcpy(rm->pv + 1, (ss + 1)->pv,
+					       sizeof(enum move) * (ss + 1)->pv_length);
+					rm->pv[(ss + 1)->pv_length + 1] = MOVE_NONE;
+					if (!thread->pv_idx)
+						thread->partial = move;
+				}
+			}
+		}
+
 		/* Step 14. Update search stats.
 		 * Best value, best move, alpha, beta and PV.
 		 */
@@ -452,7 +624,7 @@ move_loop:
 					ss->killer[0] = move;
 				}
 
-				history_update(pos, ss, move, depth);
+				history_update(&thread->history, pos, ss, move, depth);
 			}
 			break;
 		}
@@ -461,8 +633,9 @@ move_loop:
 			alpha = value;
 
 			ss->pv[0] = bestmove;
-			memcpy(ss->pv + 1, (ss + 1)->pv, sizeof(enum move) * new_depth);
-			ss->pv[new_depth] = MOVE_NONE;
+			memcpy(ss->pv + 1, (ss + 1)->pv,
+			       sizeof(enum move) * (ss + 1)->pv_length);
+			ss->pv_length = (ss + 1)->pv_length + 1;
 		}
 	}
 
@@ -475,9 +648,10 @@ move_loop:
 
 	/* Step 16. Store results in the Transposition Table.
 	 * Store the hashmove and the value of the position at the current
-	 * depth.
+	 * depth. MultiPV lines after the first exclude the better root moves,
+	 * so their result would overwrite the first line's.
 	 */
-	if (ss->skip == MOVE_NONE) {
+	if (ss->skip == MOVE_NONE && !(isroot && thread->pv_idx)) {
 		tt_bound = best_value <= orig_alpha ? TT_UPPER
 			 : best_value >= beta       ? TT_LOWER
 						    : TT_EXACT;
@@ -487,126 +661,579 @@ move_loop:
 	return best_value;
 }
 
-void *search(void *arg)
+void search(struct search_thread *thread)
 {
-	struct arg *starg = arg;
-	struct position *pos = &starg->pos;
-	struct search_limits *limits = starg->limits;
-	struct search_stack search_stack[MAX_PLY + 2] = {0};
-	struct search_stack *ss = search_stack + 2;
-	int i, depth, value;
-	enum move bestmove;
+	struct search_thread *best;
+	struct search_stack *ss = stack_init(thread);
+	struct root_move *rm;
+	int i, depth, value, lines;
 	int alpha = -CHECKMATE, beta = CHECKMATE, window;
+	u64 time, last = 0;
 
-	/* initialize search stack */
-	ss[-2] = ss[-1] = (struct search_stack){
-	    .eval = UNKNOWN,
-	    .move = MOVE_NONE,
-	};
-	for (i = 0; i < MAX_PLY; i++) {
-		(ss + i)->ply = i;
-		(ss + i)->pv = ecalloc(MAX_PLY - i, sizeof(enum move));
-		(ss + i)->killer[0] = (ss + i)->killer[1] = MOVE_NONE;
-	}
+#if USE_NNUE
+	pos_set_acc(thread->pos, thread->accumulators);
+#endif
 
-	/* clear move history */
-	history_clear();
+	lines = MIN(search_options.multipv, thread->root_moves_nb);
 
-	/* clear transposition table */
-	tt_update();
+	if (thread->scheduled)
+		turn_wait(thread);
 
-	stop_time = 0;
-	if (limits->movetime != -1) {
-		limits->movestogo = 1;
-		limits->time = limits->movetime;
-	}
-	if (limits->time != -1) {
-		limits->movetime = limits->time / limits->movestogo;
-		limits->movetime += (limits->movestogo > 1) * limits->inc;
-		limits->movetime -= 50;
+	/* iterative deepening */
+	for (depth = 1; depth <= limits->depth && lines; depth++) {
+		if (setjmp(thread->jbuffer)) {
+			iteration_abort(thread);
+			break;
+		}
 
-		stop_time = limits->start + limits->movetime;
-	}
+		thread->root_depth = depth;
+		thread->partial = MOVE_NONE;
 
-	seldepth = 0;
-	nodes = 0;
-	max_nodes = limits->nodes ? limits->nodes : -1;
+		/* MultiPV.
+		 * Every line is searched with the moves of the lines before it
+		 * excluded from the root, so they share the TT and history.
+		 */
+		for (thread->pv_idx = 0; thread->pv_idx < lines; thread->pv_idx++) {
+			value = thread->root_moves[thread->pv_idx].value;
 
-	/* iterative deepening */
-	for (depth = 1; depth <= limits->depth; depth++) {
-		if (setjmp(jbuffer))
-			break;
+			window = sp->window_size;
+			if (depth >= sp->window_depth) {
+				alpha = MAX(value + window, -CHECKMATE);
+				beta  = MIN(value - window, +CHECKMATE);
+			}
 
-		window = sp->window_size;
-		if (depth >= sp->window_depth) {
-			alpha = MAX(value + window, -CHECKMATE);
-			beta  = MIN(value - window, +CHECKMATE);
+			while (true) {
+				value = negamax(thread, ss, alpha, beta, depth, false);
+				if (value <= alpha) {
+					beta = (alpha + beta) / 2;
+					alpha = MAX(alpha - window, -CHECKMATE);
+				} else if (value >= beta) {
+					beta = MIN(beta + window, +CHECKMATE);
+				} else {
+					break;
+				}
+				window = window + window / 2;
+			}
+
+			/* the PV was kept when its move raised alpha */
+			rm = root_move_find(thread, ss->pv[0]);
+			rm->value = value;
+			root_move_promote(thread, rm);
+
+			/* helpers search silently */
+			if (!thread->id)
+				print_info(thread, depth, thread->pv_idx);
 		}
 
-		while (true) {
-			value = negamax(pos, ss, alpha, beta, depth, false);
-			if (value <= alpha) {
-				beta = (alpha + beta) / 2;
-				alpha = MAX(alpha - window, -CHECKMATE);
-			} else if (value >= beta) {
-				beta = MIN(beta + window, +CHECKMATE);
-			} else {
+		rm = thread->root_moves;
+		thread->depth = depth;
+		thread->value = rm->value;
+		thread->bestmove = rm->move;
+		thread->pondermove = rm->pv[1];
+
+		if (thread->id)
+			continue;
+
+		time = gettime() - limits->start;
+		if (tm_stop(thread, time, time - last)) {
+			pthread_mutex_lock(&thread->mutex);
+			ponder_stop = ponder;
+			pthread_mutex_unlock(&thread->mutex);
+			if (!ponder_stop) {
+				stop_search();
 				break;
 			}
-			window = window + window / 2;
 		}
+		last = time;
+	}
 
-		bestmove = *ss->pv;
-
-		printf("info depth %d ", depth);
-		printf("info seldepth %d ", seldepth);
-		if (IS_MATE(value))
-			printf("score mate %d ",
-			       value > 0 ? +(CHECKMATE - value + 1) / 2
-					 : -(CHECKMATE + value + 1) / 2);
-		else
-			printf("score cp %d ", value);
-		printf("time %zu ", gettime() - limits->start);
-		printf("nodes %zu ", nodes);
-		printf("hashfull %zu ", tt_hashfull());
-		printf("pv");
-		for (i = 0; i < depth && ss->pv[i] != MOVE_NONE; i++)
-			printf(" %s", MOVE_STR(ss->pv[i]));
-		printf("\n");
+	/* The main thread keeps its turn until the helpers are stopped, or
+	 * they would search on unscheduled and could change the vote. */
+	if (thread->id) {
+		if (thread->scheduled)
+			turn_pass(thread, true);
+		return;
 	}
 
-	printf("bestmove %s\n", MOVE_STR(bestmove));
+	if (!lines)
+		printf("info depth 0 score %s 0\n",
+		       thread->pos->st->checkers ? "mate" : "cp");
 
-	for (i = 0; i < MAX_PLY; i++)
-		free((ss + i)->pv);
-	free(arg);
+	/* bestmove may not be sent before stop or ponderhit */
+	pthread_mutex_lock(&thread->mutex);
+	while (running && (limits->infinite || ponder))
+		pthread_cond_wait(&thread->cond, &thread->mutex);
+	pthread_mutex_unlock(&thread->mutex);
+
+	/* stop the helpers and pick the move of the deepest search, nobody
+	 * waits for running anymore */
+	timer_set(0);
 	running = false;
+	if (thread->scheduled)
+		turn_pass(thread, true);
+	for (i = 1; i < threads_nb; i++)
+		thread_wait(threads[i]);
+
+	best = threads[0];
+	for (i = 1; i < threads_nb; i++) {
+		if (threads[i]->bestmove != MOVE_NONE &&
+		    (threads[i]->depth > best->depth ||
+		     (threads[i]->depth == best->depth &&
+		      threads[i]->value > best->value)))
+			best = threads[i];
+	}
+
+	/* remember the PV beyond the opponent's expected reply */
+	rm = best->root_moves;
+	expected.key = 0;
+	if (rm->move == best->bestmove && rm->pv[1] != MOVE_NONE &&
+	    rm->pv[2] != MOVE_NONE) {
+		pos_do_move(&root, rm->pv[0]);
+		pos_do_move(&root, rm->pv[1]);
+		expected.key = root.key;
+		expected.move = rm->pv[2];
+		pos_undo_move(&root, rm->pv[1]);
+		pos_undo_move(&root, rm->pv[0]);
+	}
+
+	if (stopped_at)
+		printf("info string stop latency %" PRIu64 " us\n",
+		       gettime_us() - stopped_at);
+	printf("bestmove %s", MOVE_STR(best->bestmove));
+	if (best->pondermove != MOVE_NONE)
+		printf(" ponder %s", MOVE_STR(best->pondermove));
+	printf("\n");
+}
+
+/* The search stack and the PV table are part of the thread, so a search does
+ * not allocate. */
+struct search_stack *stack_init(struct search_thread *thread)
+{
+	struct search_stack *ss = thread->stack + 2;
+
+	/* the move pickers are initialized by their nodes */
+	for (int i = -2; i <= MAX_PLY; i++) {
+		ss[i].ply = i;
+		ss[i].eval = UNKNOWN;
+		ss[i].move = MOVE_NONE;
+		ss[i].pv = i >= 0 && i < MAX_PLY ? thread->pv[i] : nullptr;
+		ss[i].pv_length = 0;
+		ss[i].killer[0] = ss[i].killer[1] = MOVE_NONE;
+		ss[i].skip = MOVE_NONE;
+		ss[i].dextensions = 0;
+	}
+
+	return ss;
+}
+
+void turn_wait(struct search_thread *thread)
+{
+	pthread_mutex_lock(&sched.mutex);
+	while (sched.turn != thread->id)
+		pthread_cond_wait(&sched.cond, &sched.mutex);
+	pthread_mutex_unlock(&sched.mutex);
+}
+
+/* Hands the search over to the next scheduled thread, which may be this one
+ * again. A thread leaves for good when its search ends. */
+void turn_pass(struct search_thread *thread, bool leave)
+{
+	pthread_mutex_lock(&sched.mutex);
+	thread->scheduled = !leave;
+	sched.turn = -1;
+	for (int i = 1; i <= threads_nb; i++) {
+		if (threads[(thread->id + i) % threads_nb]->scheduled) {
+			sched.turn = (thread->id + i) % threads_nb;
+			break;
+		}
+	}
+	pthread_cond_broadcast(&sched.cond);
+	pthread_mutex_unlock(&sched.mutex);
+
+	if (!leave)
+		turn_wait(thread);
+}
+
+/* Search threads live as long as the Threads and ThreadBinding options do not
+ * change and sleep between searches. */
+void *idle_loop(void *arg)
+{
+	struct search_thread *thread;
+	int id = (intptr_t)arg;
+
+	/* Pinned before anything is allocated, so that the thread's memory
+	 * is first touched, and thus placed, on the node it runs on. */
+	if (search_options.thread_binding)
+		cpu_bind(id);
+
+	thread = ealigned_alloc(ALIGN_ON, sizeof(struct search_thread));
+	thread->id = id;
+	thread->thread = pthread_self();
+	thread->pos = ealigned_alloc(ALIGN_ON, sizeof(struct position));
+	pthread_mutex_init(&thread->mutex, nullptr);
+	pthread_cond_init(&thread->cond, nullptr);
+
+	pthread_mutex_lock(&spawn.mutex);
+	threads[id] = thread;
+	pthread_cond_signal(&spawn.cond);
+	pthread_mutex_unlock(&spawn.mutex);
+
+	pthread_mutex_lock(&thread->mutex);
+	while (true) {
+		while (!thread->searching && !thread->exit)
+			pthread_cond_wait(&thread->cond, &thread->mutex);
+		if (thread->exit)
+			break;
+		pthread_mutex_unlock(&thread->mutex);
+
+		search(thread);
+
+		pthread_mutex_lock(&thread->mutex);
+		thread->searching = false;
+		pthread_cond_broadcast(&thread->cond);
+	}
+	pthread_mutex_unlock(&thread->mutex);
+
+	return nullptr;
+}
+
+void thread_wake(struct search_thread *thread)
+{
+	pthread_mutex_lock(&thread->mutex);
+	thread->searching = true;
+	pthread_cond_broadcast(&thread->cond);
+	pthread_mutex_unlock(&thread->mutex);
+}
+
+void thread_wait(struct search_thread *thread)
+{
+	pthread_mutex_lock(&thread->mutex);
+	while (thread->searching)
+		pthread_cond_wait(&thread->cond, &thread->mutex);
+	pthread_mutex_unlock(&thread->mutex);
+}
+
+void *timer_loop([[maybe_unused]] void *arg)
+{
+	struct timespec ts;
+	u64 now, wait;
+
+	pthread_mutex_lock(&timer.mutex);
+	while (!timer.exit) {
+		if (!timer.deadline) {
+			pthread_cond_wait(&timer.cond, &timer.mutex);
+			continue;
+		}
+
+		if ((now = gettime()) >= timer.deadline) {
+			stop_search();
+			timer.deadline = 0;
+			continue;
+		}
+
+		wait = timer.deadline - now;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += wait / 1000 + (ts.tv_nsec + wait % 1000 * 1000000) / 1000000000;
+		ts.tv_nsec = (ts.tv_nsec + wait % 1000 * 1000000) % 1000000000;
+		pthread_cond_timedwait(&timer.cond, &timer.mutex, &ts);
+	}
+	pthread_mutex_unlock(&timer.mutex);
+
 	return nullptr;
 }
 
+void timer_set(u64 deadline)
+{
+	pthread_mutex_lock(&timer.mutex);
+	timer.deadline = deadline;
+	pthread_cond_signal(&timer.cond);
+	pthread_mutex_unlock(&timer.mutex);
+}
+
+/* Also wakes the main thread if it holds back bestmove. */
+void stop_search(void)
+{
+	if (!running)
+		return;
+
+	pthread_mutex_lock(&threads[0]->mutex);
+	if (atomic_exchange(&running, false)) {
+		stopped_at = gettime_us();
+		pthread_cond_broadcast(&threads[0]->cond);
+	}
+	pthread_mutex_unlock(&threads[0]->mutex);
+}
+
+void tm_init(void)
+{
+	u64 avail;
+
+	tm.soft = tm.hard = 0;
+	tm.stability = 0;
+	tm.value = UNKNOWN;
+	tm.bestmove = MOVE_NONE;
+
+	/* an infinite search only ends with stop */
+	if (limits->infinite)
+		return;
+
+	/* a fixed movetime is meant to be used up */
+	if (limits->movetime != -1) {
+		tm.hard = MAX(limits->movetime - search_options.move_overhead, 1);
+		return;
+	}
+	if (limits->time == -1)
+		return;
+
+	avail = MAX(limits->time - search_options.move_overhead, 1);
+	tm.soft = avail / MAX(limits->movestogo, 1) + limits->inc * 3 / 4;
+	tm.hard = MIN(tm.soft * 5, limits->movestogo > 1 ? avail * 3 / 4 : avail);
+	tm.hard = MAX(tm.hard, 1);
+	tm.soft = MIN(tm.soft, tm.hard);
+}
+
+/* Called by the main thread after every completed iteration. */
+bool tm_stop(struct search_thread *thread, u64 elapsed, u64 iteration)
+{
+	double scale, fraction;
+	int drop;
+
+	drop = tm.value == UNKNOWN ? 0 : tm.value - thread->value;
+	tm.stability = thread->bestmove == tm.bestmove ? tm.stability + 1 : 0;
+	tm.value = thread->value;
+	tm.bestmove = thread->bestmove;
+
+	if (!tm.soft || thread->bestmove == MOVE_NONE)
+		return false;
+
+	/* the next iteration takes at least about twice as long */
+	if (elapsed + 2 * iteration >= tm.hard)
+		return true;
+
+	fraction = (double)root_move_find(thread, thread->bestmove)->nodes /
+		   MAX(thread_nodes(thread), 1);
+
+	/* spend less time on a best move that keeps coming back, more when
+	 * the score drops or when other moves need many nodes to refute */
+	scale = 1.3 - 0.1 * MIN(tm.stability, 6);
+	scale *= 1.0 + MAX(0, MIN(drop, 100)) / 200.0;
+	scale *= (1.5 - fraction) * 1.35;
+
+	return elapsed >= tm.soft * scale;
+}
+
+struct root_move *root_move_find(struct search_thread *thread, enum move move)
+{
+	struct root_move *rm = thread->root_moves;
+	while (rm->move != move)
+		rm++;
+	return rm;
+}
+
+/* Moves the best move of the current line in front of the unreported ones. */
+void root_move_promote(struct search_thread *thread, struct root_move *rm)
+{
+	struct root_move *slot = thread->root_moves + thread->pv_idx;
+	struct root_move tmp = *rm;
+
+	memmove(slot + 1, slot, (rm - slot) * sizeof(struct root_move));
+	*slot = tmp;
+}
+
+/* Lines reported earlier in the current iteration are not searched again. */
+bool root_move_skip(struct search_thread *thread, enum move move)
+{
+	for (int i = 0; i < thread->pv_idx; i++) {
+		if (thread->root_moves[i].move == move)
+			return true;
+	}
+	return false;
+}
+
+/* An aborted iteration still changes the best move if the first line has
+ * already been finished, or if a move beat the previous best move after that
+ * one was searched to the new depth. */
+void iteration_abort(struct search_thread *thread)
+{
+	struct root_move *rm = thread->root_moves;
+
+	if (!thread->pv_idx) {
+		if (thread->partial == MOVE_NONE ||
+		    thread->partial == thread->bestmove)
+			return;
+		if (thread->bestmove != MOVE_NONE &&
+		    root_move_find(thread, thread->bestmove)->depth != thread->root_depth)
+			return;
+
+		rm = root_move_find(thread, thread->partial);
+		root_move_promote(thread, rm);
+		rm = thread->root_moves;
+
+		if (!thread->id)
+			print_info(thread, thread->root_depth, 0);
+	}
+
+	thread->value = rm->value;
+	thread->bestmove = rm->move;
+	thread->pondermove = rm->pv[1];
+}
+
+void print_info(struct search_thread *thread, int depth, int line)
+{
+	struct root_move *rm = thread->root_moves + line;
+	u64 time = gettime() - limits->start;
+	u64 nodes = search_nodes();
+	int i, value = rm->value;
+
+	printf("info depth %d ", depth);
+	printf("info seldepth %d ", thread->seldepth);
+	printf("multipv %d ", line + 1);
+	if (IS_MATE(value))
+		printf("score mate %d ",
+		       value > 0 ? +(CHECKMATE - value + 1) / 2
+				 : -(CHECKMATE + value + 1) / 2);
+	else
+		printf("score cp %d ", value);
+	printf("time %zu ", time);
+	printf("nodes %zu ", nodes);
+	printf("nps %zu ", nodes * 1000 / (time + 1));
+	printf("hashfull %zu ", tt_hashfull());
+	printf("pv");
+	for (i = 0; rm->pv[i] != MOVE_NONE; i++)
+		printf(" %s", MOVE_STR(rm->pv[i]));
+	printf("\n");
+}
+
+u64 search_nodes(void)
+{
+	u64 nodes = 0;
+	for (int i = 0; i < threads_nb; i++)
+		nodes += thread_nodes(threads[i]);
+	return nodes;
+}
+
 bool search_running(void) { return running; }
 
-void search_start(struct position *pos, struct search_limits *limits)
+void search_start(struct position *pos, struct search_limits *search_limits)
 {
-	struct arg *arg = ecalloc(1, sizeof(struct arg));
-	arg->pos = *pos; /* copy position without state pointer */
-	arg->pos.st = arg->pos.state_stack + (pos->st - pos->state_stack);
-	arg->limits = limits;
+	struct search_thread *thread;
+	enum move move_list[256], *last, *m;
+	struct root_move root_moves[256], tmp;
+	int i, root_moves_nb = 0;
+	int tt_depth, tt_value, tt_eval;
+	enum tt_bound tt_bound;
+	enum move hashmove = MOVE_NONE;
+
+	thread_wait(threads[0]);
+
+	limits = search_limits;
+	tm_init();
+	max_nodes = limits->nodes;
+	pos_copy(&root, pos);
+
+	last = mg_generate(MGT_LEGAL, move_list, pos);
+	for (m = move_list; m != last; m++)
+		root_moves[root_moves_nb++] = (struct root_move){
+		    .move = *m,
+		    .value = -CHECKMATE,
+		    .pv = {*m},
+		};
+
+	/* an aborted search leaves its children marked */
+	for (size_t j = 0; j < BUSY_SIZE; j++)
+		atomic_store_explicit(&busy[j], 0, memory_order_relaxed);
+
+	/* age transposition table, it might still be getting cleared */
+	tt_wait();
+	tt_update();
+
+	/* The game followed the previous PV, so its next move is searched
+	 * first. The TT usually still knows it, unless it was overwritten. */
+	for (i = 0; pos->key == expected.key && i < root_moves_nb; i++) {
+		if (root_moves[i].move != expected.move)
+			continue;
+
+		tmp = root_moves[i];
+		memmove(root_moves + 1, root_moves, i * sizeof(struct root_move));
+		root_moves[0] = tmp;
+
+		if (!tt_probe(pos->key, 0, &tt_depth, &tt_bound, &tt_value, &tt_eval, &hashmove) ||
+		    hashmove == MOVE_NONE)
+			tt_store(pos->key, 0, 0, TT_NONE, UNKNOWN, UNKNOWN, expected.move);
+		break;
+	}
+
+	for (i = 0; i < threads_nb; i++) {
+		thread = threads[i];
+		pos_copy(thread->pos, pos);
+		atomic_store_explicit(&thread->nodes, 0, memory_order_relaxed);
+		thread->seldepth = 0;
+		thread->depth = 0;
+		thread->value = -CHECKMATE;
+		thread->bestmove = MOVE_NONE;
+		thread->pondermove = MOVE_NONE;
+		history_age(&thread->history);
+		memcpy(thread->root_moves, root_moves,
+		       root_moves_nb * sizeof(struct root_move));
+		thread->root_moves_nb = root_moves_nb;
+		thread->scheduled = search_options.deterministic && threads_nb > 1;
+	}
+	sched.turn = 0;
+
+	stopped_at = 0;
+	/* the main thread is idle, so the flags need no lock here */
+	ponder = limits->ponder;
+	ponder_stop = false;
 	running = true;
-	if (!thrd_joined && pthread_join(thrd, nullptr))
-		die("pthread_join:");
-	else
-		thrd_joined = false;
-	if (pthread_create(&thrd, nullptr, search, arg))
-		die("pthread_create:");
+	/* also drops a deadline a late ponderhit may have left behind */
+	timer_set(tm.hard && !ponder ? limits->start + tm.hard : 0);
+	for (i = threads_nb; i--;)
+		thread_wake(threads[i]);
 }
 
 void search_stop(void)
 {
-	running = false;
-	if (!thrd_joined)
-		pthread_join(thrd, nullptr);
-	thrd_joined = true;
+	stop_search();
+	if (threads)
+		thread_wait(threads[0]);
+}
+
+/* The flag drops before the helpers are joined, so search_running() turning
+ * false does not yet mean that the TT is unused. */
+void search_wait(void)
+{
+	if (threads)
+		thread_wait(threads[0]);
+}
+
+/* The opponent played the expected move, so the search continues on our own
+ * clock. Time spent pondering counts as ours. */
+void search_ponderhit(void)
+{
+	bool hit, stop;
+
+	pthread_mutex_lock(&threads[0]->mutex);
+	hit = running && ponder;
+	stop = ponder_stop;
+	ponder = false;
+	pthread_cond_broadcast(&threads[0]->cond);
+	pthread_mutex_unlock(&threads[0]->mutex);
+
+	if (!hit)
+		return;
+	if (stop)
+		stop_search();
+	else if (tm.hard)
+		timer_set(limits->start + tm.hard);
+}
+
+/* Forgets everything learned in the previous searches, for a new game. */
+void search_clear(void)
+{
+	search_stop();
+	for (int i = 0; i < threads_nb; i++)
+		history_clear(&threads[i]->history);
+	expected.key = 0;
 }
 
 void search_init(void)
@@ -617,33 +1244,100 @@ void search_init(void)
 			    sp->lmr_base +
 			    log(depth) * log(movecount) / sp->lmr_scale;
 	}
+
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&timer.mutex, nullptr);
+	pthread_cond_init(&timer.cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (pthread_create(&timer.thread, nullptr, timer_loop, nullptr))
+		die("pthread_create:");
+
+	search_set_threads(SEARCH_DEFAULT_THREADS);
 }
 
-int search_eval(struct position *pos)
+void search_free(void)
 {
-	struct search_stack search_stack[MAX_PLY + 2] = {0};
-	struct search_stack *ss = search_stack + 2;
-	int value, i;
-
-	ss[-2] = ss[-1] = (struct search_stack){
-	    .eval = UNKNOWN,
-	    .move = MOVE_NONE,
-	    .dextensions = 0,
-	};
-	for (i = 0; i < MAX_PLY; i++) {
-		(ss + i)->ply = i;
-		(ss + i)->pv = ecalloc(MAX_PLY - i, sizeof(enum move));
-		(ss + i)->killer[0] = (ss + i)->killer[1] = MOVE_NONE;
-		(ss + i)->skip = MOVE_NONE;
-		(ss + i)->dextensions = 0;
+	threads_free();
+
+	pthread_mutex_lock(&timer.mutex);
+	timer.exit = true;
+	pthread_cond_signal(&timer.cond);
+	pthread_mutex_unlock(&timer.mutex);
+	if (pthread_join(timer.thread, nullptr))
+		die("pthread_join:");
+	pthread_mutex_destroy(&timer.mutex);
+	pthread_cond_destroy(&timer.cond);
+}
+
+void threads_free(void)
+{
+	struct search_thread *thread;
+
+	search_stop();
+
+	for (int i = 0; i < threads_nb; i++) {
+		thread = threads[i];
+		pthread_mutex_lock(&thread->mutex);
+		thread->exit = true;
+		pthread_cond_broadcast(&thread->cond);
+		pthread_mutex_unlock(&thread->mutex);
+		if (pthread_join(thread->thread, nullptr))
+			die("pthread_join:");
+
+		pthread_mutex_destroy(&thread->mutex);
+		pthread_cond_destroy(&thread->cond);
+		free(thread->pos);
+		free(thread);
+	}
+	free(threads);
+	threads = nullptr;
+	threads_nb = 0;
+}
+
+void search_set_threads(int n)
+{
+	pthread_t thread;
+
+	threads_free();
+
+	threads_nb = n;
+	threads = ecalloc(threads_nb, sizeof(struct search_thread *));
+	for (int i = 0; i < threads_nb; i++) {
+		if (pthread_create(&thread, nullptr, idle_loop, (void *)(intptr_t)i))
+			die("pthread_create:");
+
+		/* one at a time, as binding reads the affinity inherited
+		 * from this thread */
+		pthread_mutex_lock(&spawn.mutex);
+		while (!threads[i])
+			pthread_cond_wait(&spawn.cond, &spawn.mutex);
+		pthread_mutex_unlock(&spawn.mutex);
 	}
+}
+
+int search_threads(void) { return threads_nb; }
+
+int search_eval(struct position *pos)
+{
+	/* not a search thread, so it never checks the limits */
+	static struct search_thread thread = {.id = -1};
+	static struct position position;
+	struct search_stack *ss;
+	int value;
+
+	pos_copy(&position, pos);
+#if USE_NNUE
+	pos_set_acc(&position, thread.accumulators);
+#endif
+	thread.pos = &position;
+	ss = stack_init(&thread);
 
 	running = true;
-	value = quiescence(pos, ss, -CHECKMATE, CHECKMATE);
+	value = quiescence(&thread, ss, -CHECKMATE, CHECKMATE);
 	running = false;
 
-	for (i = 0; i < MAX_PLY; i++)
-		free((ss + i)->pv);
-
 	return value;
 }
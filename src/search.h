@@ -20,9 +20,12 @@
 #define KNUR_SEARCH_H_
 
 #include <pthread.h>
+#include <setjmp.h>
 #include <stdatomic.h>
 
+#include "history.h"
 #include "knur.h"
+#include "movepicker.h"
 #include "position.h"
 
 struct search_limits {
@@ -33,6 +36,7 @@ struct search_limits {
 	u64 nodes;
 	int movetime;
 	bool infinite;
+	bool ponder;
 
 	u64 start;
 };
@@ -41,10 +45,50 @@ struct search_stack {
 	int ply;             /* halfmove counter */
 	int eval;            /* static evaluation */
 	enum move move;      /* current move */
-	enum move *pv;       /* principal variation */
+	enum move *pv;       /* principal variation, a row of the PV table */
+	int pv_length;       /* number of moves in the principal variation */
 	enum move killer[2]; /* killer moves */
 	enum move skip;      /* singular move */
 	int dextensions;     /* number of double extensions */
+	struct move_picker mp[2]; /* [singular search] move pickers of the ply */
+};
+
+struct root_move {
+	enum move move;         /* legal move in the root position */
+	int value;              /* value in the last search of its line */
+	int depth;              /* last iteration which completed it */
+	u64 nodes;              /* nodes spent searching it */
+	enum move pv[MAX_PLY];  /* principal variation starting with it */
+};
+
+struct search_thread {
+	int id ALIGN;          /* thread index, 0 is the main thread */
+	pthread_t thread;      /* thread handle */
+	struct position *pos;  /* private copy of the searched position */
+	atomic_uint_least64_t nodes; /* nodes searched, written only by the thread */
+	int seldepth;          /* selective depth */
+	int depth;             /* last completed depth */
+	int value;             /* value of the last completed depth */
+	enum move bestmove;    /* best move of the last completed depth */
+	enum move pondermove;  /* expected reply to the best move */
+	jmp_buf jbuffer;       /* abort target */
+	struct history history; /* move ordering tables */
+	struct search_stack stack[MAX_PLY + 3]; /* 2 sentinels before, 1 after */
+	enum move pv[MAX_PLY][MAX_PLY]; /* triangular PV table, a row per ply */
+#if USE_NNUE
+	struct accumulator accumulators[MAX_PLY + 1]; /* one per ply */
+#endif
+	struct root_move root_moves[256]; /* legal moves in the root */
+	int root_moves_nb;     /* number of legal moves in the root */
+	int pv_idx;            /* MultiPV line being searched */
+	int root_depth;        /* depth of the current iteration */
+	enum move partial;     /* best move of the unfinished first line */
+	bool scheduled;        /* takes turns with the other threads */
+
+	pthread_mutex_t mutex; /* guards searching and exit */
+	pthread_cond_t cond;   /* signals changes of searching and exit */
+	bool searching;        /* set for the duration of a search */
+	bool exit;             /* set to terminate the thread */
 };
 
 struct search_params {
@@ -58,12 +102,37 @@ struct search_params {
 	float lmr_scale;
 };
 
+struct search_options {
+	int move_overhead; /* time in ms reserved for communication lag */
+	int multipv;       /* number of best lines to report */
+	bool deterministic; /* threads take turns, see DETERMINISTIC_NODES */
+	bool thread_binding; /* pin the threads to CPUs */
+};
+
+constexpr int SEARCH_DEFAULT_THREADS = 1;
+constexpr int SEARCH_MIN_THREADS = 1;
+constexpr int SEARCH_MAX_THREADS = 256;
+constexpr int SEARCH_DEFAULT_OVERHEAD = 50;
+constexpr int SEARCH_MIN_OVERHEAD = 0;
+constexpr int SEARCH_MAX_OVERHEAD = 5000;
+constexpr int SEARCH_DEFAULT_MULTIPV = 1;
+constexpr int SEARCH_MIN_MULTIPV = 1;
+constexpr int SEARCH_MAX_MULTIPV = 256;
+constexpr u64 DETERMINISTIC_NODES = 1024; /* nodes searched per turn */
+
 bool search_running(void);
 void search_start(struct position *position, struct search_limits *limits);
 void search_stop(void);
+void search_wait(void);
+void search_clear(void);
+void search_ponderhit(void);
 void search_init(void);
+void search_free(void);
+void search_set_threads(int threads);
+int search_threads(void);
 int search_eval(struct position *position);
 
 extern struct search_params search_params;
+extern struct search_options search_options;
 
 #endif /* KNUR_SEARCH_H_ */
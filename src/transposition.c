@@ -16,6 +16,8 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <assert.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,28 +26,61 @@
 #include "transposition.h"
 #include "util.h"
 
-constexpr size_t TT_BUCKETS = 3;
-
-struct __attribute__((packed)) tt_entry {
-	u64 key : 16;
-	int depth : 8;
-	int age : 6;
-	enum tt_bound bound : 2;
-	int16_t value;
-	int16_t eval;
-	enum move move;
+union tt_data {
+	struct __attribute__((packed)) {
+		int depth : 8;
+		int age : 6;
+		enum tt_bound bound : 2;
+		int16_t value;
+		int16_t eval;
+		enum move move;
+	};
+	u64 raw;
 };
 
-struct tt_bucket {
-	struct tt_entry entries[TT_BUCKETS];
-	uint16_t padding;
+/* A cluster fills exactly one cache line. Keys hold the lower 32 bits of
+ * the zobrist key xored with a checksum of the data, so an entry torn by a
+ * concurrent write fails verification instead of being used. */
+struct tt_cluster {
+	uint32_t keys[TT_CLUSTER_SIZE];
+	u64 data[TT_CLUSTER_SIZE];
+} ALIGN;
+
+static_assert(sizeof(struct tt_cluster) == ALIGN_ON,
+	      "TT_CLUSTER_SIZE entries do not fit in a cache line");
+
+__extension__ typedef unsigned __int128 u128;
+
+constexpr int TT_CLEAR_MAX_WORKERS = 64;
+
+struct tt_slice {
+	struct tt_cluster *begin;
+	size_t size;
 };
 
 static struct {
-	struct tt_bucket *buckets;
-	size_t mask;
+	struct tt_cluster *clusters;
+	size_t size;
+	enum page_kind pages;
 	int age;
-} tt = {nullptr, 0, 0};
+	pthread_t *workers; /* threads clearing the table */
+	struct tt_slice *slices;
+	int workers_nb;
+} tt = {nullptr, 0, PAGE_NORMAL, 0, nullptr, nullptr, 0};
+
+static void *tt_clear_slice(void *arg);
+
+/* Maps the upper bits of the key onto [0, size) with a multiply-high,
+ * so the table does not need a power of two size. */
+INLINE struct tt_cluster *tt_cluster(u64 key)
+{
+	return &tt.clusters[((u128)key * tt.size) >> 64];
+}
+
+INLINE uint32_t checksum(u64 data)
+{
+	return data ^ (data >> 32);
+}
 
 INLINE int value_from(int value, int ply)
 {
@@ -59,51 +94,95 @@ INLINE int value_to(int value, int ply)
 
 void tt_init(size_t mb)
 {
-	size_t keysize = 16;
+	tt_free();
 
-	if (tt.mask)
-		free(tt.buckets);
-
-	while ((1ull << keysize) * sizeof(struct tt_bucket) <=
-	       mb * MEBIBYTE / 2)
-		keysize++;
-
-	tt.buckets = ecalloc(1, (1ull << keysize) * sizeof(struct tt_bucket));
-	tt.mask = (1ull << keysize) - 1u;
+	tt.size = mb * MEBIBYTE / sizeof(struct tt_cluster);
+	tt.clusters = huge_alloc(tt.size * sizeof(struct tt_cluster), &tt.pages);
+	/* every thread probes all of it, so no NUMA node should own it */
+	numa_interleave(tt.clusters, tt.size * sizeof(struct tt_cluster));
 
+	/* huge_alloc() does not zero the memory, so this is the only pass
+	 * over it and each page is first touched by one of the workers */
 	tt_clear();
 }
 
 void tt_free(void)
 {
-	if (tt.mask)
-		free(tt.buckets);
-	tt.mask = 0;
+	tt_wait();
+	huge_free(tt.clusters, tt.size * sizeof(struct tt_cluster), tt.pages);
+	tt.clusters = nullptr;
+	tt.size = 0;
+}
+
+const char *tt_pages(void)
+{
+	return page_kind_str(tt.pages);
 }
 
+void *tt_clear_slice(void *arg)
+{
+	struct tt_slice *slice = arg;
+	memset(slice->begin, 0, slice->size * sizeof(struct tt_cluster));
+	return nullptr;
+}
+
+/* Returns right away, tt_wait() has to be called before the table is used.
+ * The work is split over every CPU we may use, whatever the search threads,
+ * but a worker gets at least a mebibyte. */
 void tt_clear(void)
 {
-	memset(tt.buckets, 0, (tt.mask + 1) * sizeof(struct tt_bucket));
+	int i, threads;
+
+	tt_wait();
+
+	threads = MIN(cpu_count(), TT_CLEAR_MAX_WORKERS);
+	threads = MAX(1, MIN((size_t)threads,
+			     tt.size * sizeof(struct tt_cluster) / MEBIBYTE));
+
+	tt.workers = ecalloc(threads, sizeof(pthread_t));
+	tt.slices = ecalloc(threads, sizeof(struct tt_slice));
+	for (i = 0; i < threads; i++) {
+		tt.slices[i].begin = tt.clusters + tt.size * i / threads;
+		tt.slices[i].size = tt.size * (i + 1) / threads -
+				    tt.size * i / threads;
+		if (pthread_create(&tt.workers[i], nullptr, tt_clear_slice,
+				   &tt.slices[i]))
+			die("pthread_create:");
+	}
+	tt.workers_nb = threads;
 	tt.age = 0;
 }
 
+void tt_wait(void)
+{
+	for (int i = 0; i < tt.workers_nb; i++)
+		if (pthread_join(tt.workers[i], nullptr))
+			die("pthread_join:");
+
+	free(tt.workers);
+	free(tt.slices);
+	tt.workers = nullptr;
+	tt.slices = nullptr;
+	tt.workers_nb = 0;
+}
+
 bool tt_probe(u64 key, int ply, int *depth, enum tt_bound *bound, int *value, int *eval, enum move *move)
 {
 	size_t i;
-	struct tt_entry *et = tt.buckets[key & tt.mask].entries;
-	key >>= 48;
+	struct tt_cluster *cl = tt_cluster(key);
+	union tt_data data;
+	key = (uint32_t)key;
 
-	for (i = 0; i < TT_BUCKETS; i++, et++) {
-		if (et->key != key)
+	for (i = 0; i < TT_CLUSTER_SIZE; i++) {
+		data.raw = cl->data[i];
+		if ((cl->keys[i] ^ checksum(data.raw)) != key)
 			continue;
 
-		et->age = tt.age;
-
-		*depth = et->depth;
-		*bound = et->bound;
-		*value = value_from(et->value, ply);
-		*eval = et->eval;
-		*move = et->move;
+		*depth = data.depth;
+		*bound = data.bound;
+		*value = value_from(data.value, ply);
+		*eval = data.eval;
+		*move = data.move;
 
 		return true;
 	}
@@ -113,31 +192,41 @@ bool tt_probe(u64 key, int ply, int *depth, enum tt_bound *bound, int *value, in
 
 void tt_store(u64 key, int ply, int depth, enum tt_bound bound, int value, int eval, enum move move)
 {
-	size_t i;
-	struct tt_entry *et = tt.buckets[key & tt.mask].entries, *old = et;
-	key >>= 48;
-
-	for (i = 0; i < TT_BUCKETS && et->key != key; i++, et++) {
-		if (old->depth - (tt.age - old->age) >=
-		     et->depth - (tt.age -  et->age))
-			old = et;
+	size_t i, old = 0;
+	struct tt_cluster *cl = tt_cluster(key);
+	union tt_data data, old_data = {.raw = cl->data[0]}, et_data;
+	key = (uint32_t)key;
+
+	for (i = 0; i < TT_CLUSTER_SIZE; i++) {
+		et_data.raw = cl->data[i];
+		if ((cl->keys[i] ^ checksum(et_data.raw)) == key)
+			break;
+		if (old_data.depth - (tt.age - old_data.age) >=
+		     et_data.depth - (tt.age -  et_data.age)) {
+			old = i;
+			old_data = et_data;
+		}
 	}
 
-	old = (i < TT_BUCKETS) ? et : old;
-
-	if (bound != TT_EXACT && key == old->key && depth < old->depth - 2)
-		return;
+	if (i < TT_CLUSTER_SIZE) {
+		old = i;
+		old_data = et_data;
 
-	if (move != MOVE_NONE || key != old->key)
-		old->move = move;
+		if (bound != TT_EXACT && depth < old_data.depth - 2)
+			return;
+		if (move == MOVE_NONE)
+			move = old_data.move;
+	}
 
-	old->age = tt.age;
+	data.depth = depth;
+	data.age = tt.age;
+	data.bound = bound;
+	data.value = value_to(value, ply);
+	data.eval = eval;
+	data.move = move;
 
-	old->depth = depth;
-	old->bound = bound;
-	old->value = value_to(value, ply);
-	old->eval = eval;
-	old->key = key;
+	cl->data[old] = data.raw;
+	cl->keys[old] = key ^ checksum(data.raw);
 }
 
 void tt_update(void)
@@ -147,28 +236,35 @@ void tt_update(void)
 
 void tt_prefetch(u64 key)
 {
-	__builtin_prefetch(&tt.buckets[key & tt.mask]);
+	__builtin_prefetch(tt_cluster(key));
 }
 
 size_t tt_hashfull(void)
 {
 	size_t used = 0, i, j;
+	union tt_data data;
 
-	for (i = 0; i < 1000; i++)
-		for (j = 0; j < TT_BUCKETS; j++)
-			used += tt.buckets[i].entries[j].bound != TT_NONE &&
-				tt.buckets[i].entries[j].age == tt.age;
+	for (i = 0; i < 1000; i++) {
+		for (j = 0; j < TT_CLUSTER_SIZE; j++) {
+			data.raw = tt.clusters[i].data[j];
+			used += data.bound != TT_NONE && data.age == tt.age;
+		}
+	}
 
-	return used / TT_BUCKETS;
+	return used / TT_CLUSTER_SIZE;
 }
 
 /* Pawn Hash Table {{{ */
-struct __attribute__((packed)) pht_entry {
-	u64 wpawns : 48;
-	u64 bpawns : 48;
-	int value : 32;
+/* Pawns never stand on the first and last rank, so each side's pawns fit in
+ * 48 bits and the remaining 16 hold half of the value. The threads share the
+ * table, so the first word is stored xored with the second, and a torn entry
+ * fails the pawn comparison like a torn TT entry fails its checksum. */
+struct pht_entry {
+	u64 white; /* white pawns, low half of the value; xored with black */
+	u64 black; /* black pawns, high half of the value */
 };
 
+constexpr u64 PHT_PAWNS = 0xFFFFFFFFFFFF;
 
 static struct {
 	size_t size;
@@ -202,21 +298,24 @@ void pht_clear(void)
 bool pht_probe(u64 key, u64 wpawns, u64 bpawns, int *value)
 {
 	struct pht_entry *et = &pht.entries[key >> pht.shift];
+	u64 black = et->black, white = et->white ^ black;
 
-	if (wpawns == et->wpawns << 8 && bpawns == et->bpawns << 8) {
-		*value = et->value;
-		return true;
-	}
+	if ((white & PHT_PAWNS) != wpawns >> 8 ||
+	    (black & PHT_PAWNS) != bpawns >> 8)
+		return false;
 
-	return false;
+	*value = (int)(uint32_t)(white >> 48 | black >> 48 << 16);
+	return true;
 }
 
 void pht_store(u64 key, u64 wpawns, u64 bpawns, int value)
 {
 	struct pht_entry *et = &pht.entries[key >> pht.shift];
 
-	et->wpawns = wpawns >> 8;
-	et->bpawns = bpawns >> 8;
-	et->value = value;
+	u64 black = bpawns >> 8 | (u64)((uint32_t)value >> 16) << 48;
+	u64 white = wpawns >> 8 | (u64)((uint32_t)value & 0xFFFF) << 48;
+
+	et->white = white ^ black;
+	et->black = black;
 }
 /* }}} */
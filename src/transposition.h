@@ -25,7 +25,7 @@
 
 constexpr size_t TT_DEFAULT_SIZE = 16;
 constexpr size_t TT_MIN_SIZE = 1;
-constexpr size_t TT_MAX_SIZE = 1024;
+constexpr size_t TT_MAX_SIZE = 65536;
 
 constexpr size_t MEBIBYTE = 1ULL << 20;
 
@@ -39,6 +39,8 @@ enum tt_bound {
 void tt_init(size_t mb);
 void tt_free(void);
 void tt_clear(void);
+void tt_wait(void);
+const char *tt_pages(void);
 bool tt_probe(u64 key, int ply, int *depth, enum tt_bound *bound, int *value, int *eval, enum move *move);
 void tt_store(u64 key, int ply, int  depth, enum tt_bound  bound, int  value, int  eval, enum move  move);
 void tt_update(void);
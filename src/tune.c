@@ -305,6 +305,7 @@ int main(int argc, char *argv[])
 	evaluate_init();
 	pos_init();
 	tt_init(TT_DEFAULT_SIZE);
+	tt_wait();
 	pht_init(2);
 
 	if (argc != 2)
@@ -48,6 +48,7 @@ static void ucinewgame(struct position *position, char *fmt);
 static void position(struct position *position, char *fmt);
 static void go(struct position *position, char *fmt);
 static void stop(struct position *position, char *fmt);
+static void ponderhit(struct position *position, char *fmt);
 static void quit(struct position *position, char *fmt);
 
 /* non-uci functions */
@@ -62,6 +63,7 @@ static struct parser parser[] = {
     {"position",   position  },
     {"go",         go        },
     {"stop",       stop      },
+    {"ponderhit",  ponderhit },
     {"quit",       quit      },
     {"d\0",        display_  },
     {"perft",      perft_    },
@@ -78,12 +80,22 @@ void uci([[maybe_unused]] struct position *pos, [[maybe_unused]] char *fmt)
 
 	/*printf("option name ...");*/
 	printf(spin, "Hash", TT_DEFAULT_SIZE, TT_MIN_SIZE, TT_MAX_SIZE);
+	printf(spin, "Threads", SEARCH_DEFAULT_THREADS, SEARCH_MIN_THREADS,
+	       SEARCH_MAX_THREADS);
+	printf("option name Ponder type check default false\n");
+	printf(spin, "MultiPV", SEARCH_DEFAULT_MULTIPV, SEARCH_MIN_MULTIPV,
+	       SEARCH_MAX_MULTIPV);
+	printf(spin, "Move Overhead", SEARCH_DEFAULT_OVERHEAD,
+	       SEARCH_MIN_OVERHEAD, SEARCH_MAX_OVERHEAD);
+	printf("option name Deterministic type check default false\n");
+	printf("option name ThreadBinding type check default false\n");
 
 	printf("uciok\n");
 }
 
 void isready([[maybe_unused]] struct position *pos, [[maybe_unused]] char *fmt)
 {
+	tt_wait();
 	printf("readyok\n");
 }
 
@@ -93,17 +105,47 @@ void setoption([[maybe_unused]] struct position *pos, char *fmt)
 	int x;
 	if (search_running())
 		return;
+	/* a stopped search may still be collecting its helpers */
+	search_wait();
 
 	if (is_prefix(fmt, OPT_VAL(Hash))) {
 		sscanf(fmt, "%*s %*s %*s %*s %d", &x);
+		x = MAX((int)TT_MIN_SIZE, MIN((int)TT_MAX_SIZE, x));
 		tt_init(x);
 		printf("info string set Hash to value %d\n", x);
+		printf("info string Hash backed by %s\n", tt_pages());
+	} else if (is_prefix(fmt, OPT_VAL(Threads))) {
+		sscanf(fmt, "%*s %*s %*s %*s %d", &x);
+		x = MAX(SEARCH_MIN_THREADS, MIN(SEARCH_MAX_THREADS, x));
+		search_set_threads(x);
+		printf("info string set Threads to value %d\n", x);
+	} else if (is_prefix(fmt, OPT_VAL(Move Overhead))) {
+		sscanf(fmt, "%*s %*s %*s %*s %*s %d", &x);
+		x = MAX(SEARCH_MIN_OVERHEAD, MIN(SEARCH_MAX_OVERHEAD, x));
+		search_options.move_overhead = x;
+		printf("info string set Move Overhead to value %d\n", x);
+	} else if (is_prefix(fmt, OPT_VAL(MultiPV))) {
+		sscanf(fmt, "%*s %*s %*s %*s %d", &x);
+		x = MAX(SEARCH_MIN_MULTIPV, MIN(SEARCH_MAX_MULTIPV, x));
+		search_options.multipv = x;
+		printf("info string set MultiPV to value %d\n", x);
+	} else if (is_prefix(fmt, OPT_VAL(Deterministic))) {
+		search_options.deterministic = !!strstr(fmt, "value true");
+		printf("info string set Deterministic to value %s\n",
+		       search_options.deterministic ? "true" : "false");
+	} else if (is_prefix(fmt, OPT_VAL(ThreadBinding))) {
+		search_options.thread_binding = !!strstr(fmt, "value true");
+		/* the threads bind themselves when they start */
+		search_set_threads(search_threads());
+		printf("info string set ThreadBinding to value %s\n",
+		       search_options.thread_binding ? "true" : "false");
 	}
 }
 
 void ucinewgame(struct position *pos, [[maybe_unused]] char *fmt)
 {
 	pos_set_fen(pos, nullptr);
+	search_clear();
 	tt_clear();
 }
 
@@ -148,8 +190,10 @@ void go(struct position *pos, char *fmt)
 	limits.inc = 0;
 	limits.movestogo = 30;
 	limits.depth = MAX_PLY - 1;
+	limits.nodes = 0;
 	limits.movetime = -1;
 	limits.infinite = false;
+	limits.ponder = false;
 	limits.start = gettime();
 
 	for (token = strtok_r(fmt, " ", &saveptr); token;
@@ -184,6 +228,8 @@ void go(struct position *pos, char *fmt)
 			limits.movetime = atoi(token);
 		} else if (!strcmp(token, "infinite")) {
 			limits.infinite = true;
+		} else if (!strcmp(token, "ponder")) {
+			limits.ponder = true;
 		}
 	}
 
@@ -195,6 +241,12 @@ void stop([[maybe_unused]] struct position *pos, [[maybe_unused]] char *fmt)
 	search_stop();
 }
 
+void ponderhit([[maybe_unused]] struct position *pos,
+	       [[maybe_unused]] char *fmt)
+{
+	search_ponderhit();
+}
+
 void quit(struct position *pos, char *fmt)
 {
 	stop(pos, fmt);
@@ -253,9 +305,9 @@ void readline(char *input)
 enum move parse_move(struct position *pos, char *move_str)
 {
 	enum move move_list[256], *last, *m;
-	last = mg_generate(MGT_ALL, move_list, pos);
+	last = mg_generate(MGT_LEGAL, move_list, pos);
 	for (m = move_list; m != last; m++) {
-		if (!strcmp(MOVE_STR(*m), move_str) && pos_is_legal(pos, *m))
+		if (!strcmp(MOVE_STR(*m), move_str))
 			return *m;
 	}
 	return MOVE_NONE;
@@ -16,15 +16,68 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#endif
 
 #include "util.h"
 
+constexpr size_t HUGE_PAGE_SIZE = 2 << 20;
+
+static bool thp_enabled(void);
+static int node_cpus(int node, int *cpus, int max);
+
+/* /sys/kernel/mm/transparent_hugepage/enabled reads like
+ * "always [madvise] never", with the active mode in brackets. */
+bool thp_enabled(void)
+{
+	char buf[64] = {0};
+	FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+
+	if (!f)
+		return false;
+	if (!fgets(buf, sizeof(buf), f))
+		buf[0] = '\0';
+	fclose(f);
+	return buf[0] && !strstr(buf, "[never]");
+}
+
+/* /sys/devices/system/node/node<N>/cpulist reads like "0-15,32-47". */
+int node_cpus(int node, int *cpus, int max)
+{
+	char path[64];
+	int first, last, n = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	if (!(f = fopen(path, "r")))
+		return 0;
+	while (fscanf(f, "%d", &first) == 1) {
+		if (fscanf(f, "-%d", &last) != 1)
+			last = first;
+		for (; first <= last && n < max; first++)
+			cpus[n++] = first;
+		if (fgetc(f) != ',')
+			break;
+	}
+	fclose(f);
+	return n;
+}
+
 void die(const char *fmt, ...)
 {
 	va_list ap;
@@ -51,6 +104,151 @@ void *ecalloc(size_t nmemb, size_t size)
 	return p;
 }
 
+/* zeroed, size does not have to be a multiple of alignment */
+void *ealigned_alloc(size_t alignment, size_t size)
+{
+	void *p;
+	size = (size + alignment - 1) / alignment * alignment;
+	if (!(p = aligned_alloc(alignment, size)))
+		die("aligned_alloc:");
+	return memset(p, 0, size);
+}
+
+/* Not zeroed. Tries transparent huge pages first, then hugetlbfs and then
+ * falls back to regular pages. */
+void *huge_alloc(size_t size, enum page_kind *kind)
+{
+	void *p = nullptr;
+	size_t huge_size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE *
+			   HUGE_PAGE_SIZE;
+
+#ifdef MADV_HUGEPAGE
+	if (thp_enabled() && (p = aligned_alloc(HUGE_PAGE_SIZE, huge_size))) {
+		if (!madvise(p, huge_size, MADV_HUGEPAGE)) {
+			*kind = PAGE_TRANSPARENT_HUGE;
+			return p;
+		}
+		free(p);
+	}
+#endif
+
+#ifdef MAP_HUGETLB
+	p = mmap(nullptr, huge_size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED) {
+		*kind = PAGE_HUGETLB;
+		return p;
+	}
+#endif
+
+	if (!(p = aligned_alloc(HUGE_PAGE_SIZE, huge_size)))
+		die("aligned_alloc:");
+	*kind = PAGE_NORMAL;
+	return p;
+}
+
+void huge_free(void *ptr, size_t size, enum page_kind kind)
+{
+	size_t huge_size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE *
+			   HUGE_PAGE_SIZE;
+
+	if (!ptr)
+		return;
+	if (kind == PAGE_HUGETLB)
+		munmap(ptr, huge_size);
+	else
+		free(ptr);
+}
+
+const char *page_kind_str(enum page_kind kind)
+{
+	switch (kind) {
+	case PAGE_TRANSPARENT_HUGE: return "transparent huge pages";
+	case PAGE_HUGETLB:          return "hugetlbfs pages";
+	case PAGE_NORMAL:           [[fallthrough]];
+	default:                    return "regular pages";
+	}
+}
+
+/* 1 if the system does not describe its NUMA nodes. */
+int numa_nodes(void)
+{
+	char path[64];
+	int n = 0;
+
+	do
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", n);
+	while (!access(path, F_OK) && ++n < 64);
+	return n ? n : 1;
+}
+
+/* Number of CPUs the process may run on, at least 1. */
+int cpu_count(void)
+{
+	long n;
+#ifdef __linux__
+	cpu_set_t set;
+
+	if (!sched_getaffinity(0, sizeof(set), &set) && CPU_COUNT(&set) > 0)
+		return CPU_COUNT(&set);
+#endif
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 && n < 1 << 16 ? n : 1;
+}
+
+/* Spreads the pages over all nodes, for memory every thread uses alike. It has
+ * to be called before the memory is first touched. */
+void numa_interleave(void *ptr, size_t size)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+	unsigned long mask;
+	int nodes = numa_nodes();
+
+	if (nodes < 2)
+		return;
+	mask = nodes < 64 ? (1UL << nodes) - 1 : ~0UL;
+	/* best effort, the memory is usable either way */
+	syscall(SYS_mbind, ptr, size, MPOL_INTERLEAVE, &mask,
+		8 * sizeof(mask) + 1, 0);
+#else
+	(void)ptr;
+	(void)size;
+#endif
+}
+
+/* Pins the calling thread to one of the CPUs it may run on. Consecutive
+ * indices go to different NUMA nodes, so the threads are spread evenly. On a
+ * single node there is nothing to gain, so the affinity is left alone. */
+bool cpu_bind(int index)
+{
+#ifdef __linux__
+	int cpus[CPU_SETSIZE];
+	cpu_set_t allowed, set;
+	int nodes = numa_nodes(), n, i, j;
+
+	if (nodes <= 1 || sched_getaffinity(0, sizeof(allowed), &allowed))
+		return false;
+
+	if (!(n = node_cpus(index % nodes, cpus, CPU_SETSIZE)))
+		return false;
+	index /= nodes;
+
+	/* only the CPUs we are allowed to use */
+	for (i = j = 0; i < n; i++)
+		if (cpus[i] < CPU_SETSIZE && CPU_ISSET(cpus[i], &allowed))
+			cpus[j++] = cpus[i];
+	if (!j)
+		return false;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpus[index % j], &set);
+	return !pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	(void)index;
+	return false;
+#endif
+}
+
 uint64_t rand_sparse_u64(void) { return rand_u64() & rand_u64() & rand_u64(); }
 
 /* xorshiro */
@@ -75,3 +273,10 @@ uint64_t gettime(void)
 	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
 	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
+
+uint64_t gettime_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -22,6 +22,12 @@
 #include <stddef.h>
 #include <stdint.h>
 
+enum page_kind {
+	PAGE_NORMAL,           /* default pages of the system */
+	PAGE_TRANSPARENT_HUGE, /* madvise(MADV_HUGEPAGE) on 2 MiB aligned memory */
+	PAGE_HUGETLB,          /* explicit hugetlbfs pages */
+};
+
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 #define ARRAY_FILL(arr, val)                                                   \
 	do {                                                                   \
@@ -31,8 +37,17 @@
 
 [[noreturn]] void die(const char *fmt, ...);
 void *ecalloc(size_t nmemb, size_t size);
+void *ealigned_alloc(size_t alignment, size_t size);
+void *huge_alloc(size_t size, enum page_kind *kind);
+void huge_free(void *ptr, size_t size, enum page_kind kind);
+const char *page_kind_str(enum page_kind kind);
+int numa_nodes(void);
+int cpu_count(void);
+void numa_interleave(void *ptr, size_t size);
+bool cpu_bind(int index);
 uint64_t rand_sparse_u64(void);
 uint64_t rand_u64(void);
 uint64_t gettime(void);
+uint64_t gettime_us(void);
 
 #endif /* KNUR_UTIL_H_ */